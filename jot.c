@@ -55,7 +55,11 @@
 
 #include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -68,6 +72,14 @@
 #define ENDER_DEF      100
 #define STEP_DEF       1
 
+#define OUTS_MAX       256              /* Maximum number of -o/-O outputs. */
+#define OUTBUF_SIZE    65536            /* Per-output buffer size. */
+#define BLOCK_DEF      1024             /* Default -k for unbounded output. */
+
+#define MODE_RR        0                /* Round-robin distribution. */
+#define MODE_BLOCK     1                /* Contiguous blocks. */
+#define MODE_HASH      2                /* Hash of the formatted value. */
+
 #define is_default(s)  (strcmp((s), "-") == 0)
 
 double      begin;
@@ -86,6 +98,30 @@ int         nofinalnl;
 const char *sepstring = "\n";
 char        format[BUFSIZ];
 
+/**
+ * @brief A fan-out output.
+ *
+ * Each output has its own buffer which is flushed with large writes.
+ */
+struct output {
+  int    fd;                            /* Output file descriptor. */
+  int    opened;                        /* Non-zero if we opened @c fd. */
+  int    used;                          /* Non-zero once data was sent. */
+  int    flags;                         /* File status flags before -N. */
+  size_t len;                           /* Bytes pending in @c buf. */
+  char   buf[OUTBUF_SIZE];              /* Pending output. */
+};
+
+struct output *outs;                    /* Fan-out outputs. */
+int            nouts;                   /* Number of fan-out outputs. */
+int            outmode  = MODE_RR;      /* Distribution mode (-m). */
+long           blocksz;                 /* Elements per block (-k). */
+int            nonblock;                /* Nonblocking backpressure (-N). */
+long           nelem;                   /* Elements dispatched so far. */
+int            rrnext;                  /* Next round-robin output. */
+char           elembuf[BUFSIZ * 2];     /* Element being formatted. */
+size_t         elemlen;                 /* Length of @c elembuf. */
+
 #if !defined(BSD)
 # include <sys/types.h>
 
@@ -140,12 +176,381 @@ strlcpy(char *dst, const char *src, size_t siz)
 static void
 usage(void)
 {
-  fprintf(stderr, "%s\n%s\n",
-          "usage: jot [-cnr] [-b word] [-w word] [-s string] [-p precision]",
+  fprintf(stderr, "%s\n%s\n%s\n",
+          "usage: jot [-cnNr] [-b word] [-w word] [-s string] [-p precision]",
+          "           [-o file ...] [-O fd ...] [-m rr|block|hash] [-k count]",
           "           [reps [begin [end [s]]]]");
   exit(EXIT_FAILURE);
 }
 
+/**
+ * @brief Write all of @c len bytes from @c buf to @c fd.
+ * @param fd The file descriptor.
+ * @param buf The data to write.
+ * @param len The length of the data.
+ *
+ * Waits for the descriptor to become writable should it be
+ * nonblocking and full.
+ */
+static void
+writeall(int fd, const char *buf, size_t len)
+{
+  struct pollfd pfd;
+  ssize_t       n;
+  
+  while (len > 0) {
+    n = write(fd, buf, len);
+    
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        pfd.fd     = fd;
+        pfd.events = POLLOUT;
+        poll(&pfd, 1, -1);
+        continue;
+      }
+      
+      err(1, "write");
+    }
+    
+    buf += n;
+    len -= n;
+  }
+}
+
+/**
+ * @brief Write out as much pending data of an output as possible.
+ * @param o The output.
+ * @returns 0 if the buffer was emptied; otherwise -1 if the output
+ *          would block.
+ */
+static int
+flushout(struct output *o)
+{
+  size_t  off = 0;
+  ssize_t n;
+  
+  while (off < o->len) {
+    n = write(o->fd, o->buf + off, o->len - off);
+    
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      
+      err(1, "write");
+    }
+    
+    off += n;
+  }
+  
+  if (off > 0) {
+    memmove(o->buf, o->buf + off, o->len - off);
+    o->len -= off;
+  }
+  
+  return (o->len == 0) ? 0 : -1;
+}
+
+/**
+ * @brief Wait until some blocked output becomes writable.
+ *
+ * Every output with pending data is polled, and each one that becomes
+ * writable is flushed, so a single slow consumer does not hold up the
+ * others.
+ */
+static void
+waitouts(void)
+{
+  struct pollfd pfd[OUTS_MAX];
+  int           map[OUTS_MAX];
+  int           n = 0;
+  int           i;
+  
+  for (i = 0; i < nouts; i++) {
+    if (outs[i].len > 0) {
+      pfd[n].fd      = outs[i].fd;
+      pfd[n].events  = POLLOUT;
+      pfd[n].revents = 0;
+      map[n++]       = i;
+    }
+  }
+  
+  if (n == 0) {
+    return;
+  }
+  
+  while (poll(pfd, n, -1) < 0) {
+    if (errno != EINTR) {
+      err(1, "poll");
+    }
+  }
+  
+  for (i = 0; i < n; i++) {
+    if (pfd[i].revents & (POLLOUT | POLLERR | POLLHUP)) {
+      flushout(&outs[map[i]]);
+    }
+  }
+}
+
+/**
+ * @brief Make room for @c need bytes in an output's buffer.
+ * @param o The output.
+ * @param need The number of bytes required.
+ */
+static void
+makeroom(struct output *o, size_t need)
+{
+  if (need > OUTBUF_SIZE) {
+    need = OUTBUF_SIZE;
+  }
+  
+  while (OUTBUF_SIZE - o->len < need) {
+    if (flushout(o) == 0) {
+      break;
+    }
+    
+    waitouts();
+  }
+}
+
+/**
+ * @brief Append data to an output, flushing it as required.
+ * @param o The output.
+ * @param data The data.
+ * @param len The length of the data.
+ */
+static void
+outappend(struct output *o, const char *data, size_t len)
+{
+  makeroom(o, len);
+  
+  if (len > OUTBUF_SIZE - o->len) {
+    /* Too large to buffer at all, so write it straight out. */
+    writeall(o->fd, data, len);
+    return;
+  }
+  
+  memcpy(o->buf + o->len, data, len);
+  o->len += len;
+}
+
+/**
+ * @brief Compute the FNV-1a hash of some data.
+ * @param data The data.
+ * @param len The length of the data.
+ * @returns The hash value.
+ */
+static uint32_t
+fnv1a(const char *data, size_t len)
+{
+  uint32_t h = 2166136261U;
+  
+  while (len--) {
+    h ^= (unsigned char)*data++;
+    h *= 16777619U;
+  }
+  
+  return h;
+}
+
+/**
+ * @brief Select the output that is to receive the current element.
+ * @param need The number of bytes the element requires.
+ * @returns The index of the output.
+ */
+static int
+pickout(size_t need)
+{
+  int i;
+  int idx;
+  
+  switch (outmode) {
+    case MODE_BLOCK:
+      return (nelem / blocksz) % nouts;
+      
+    case MODE_HASH:
+      return fnv1a(elembuf, elemlen) % nouts;
+      
+    default:
+      break;
+  }
+  
+  /*
+   * Round-robin.  With -N, skip over any output that cannot take the
+   * element without blocking.
+   */
+  for (;;) {
+    for (i = 0; i < nouts; i++) {
+      idx = (rrnext + i) % nouts;
+      
+      if (!nonblock ||
+          need > OUTBUF_SIZE ||
+          OUTBUF_SIZE - outs[idx].len >= need ||
+          flushout(&outs[idx]) == 0)
+      {
+        rrnext = (idx + 1) % nouts;
+        return idx;
+      }
+    }
+    
+    waitouts();
+  }
+}
+
+/**
+ * @brief Send the formatted element to one of the fan-out outputs.
+ */
+static void
+dispatch(void)
+{
+  struct output *o;
+  size_t         seplen = strlen(sepstring);
+  
+  o = &outs[pickout(elemlen + seplen)];
+  
+  if (o->used) {
+    outappend(o, sepstring, seplen);
+  }
+  
+  outappend(o, elembuf, elemlen);
+  o->used = 1;
+  elemlen = 0;
+  nelem++;
+}
+
+/**
+ * @brief Restore the file status flags changed by -N.
+ *
+ * Descriptors given with -O share their open file description with
+ * whoever passed them in, such as the shell's terminal.
+ */
+static void
+restoreouts(void)
+{
+  int i;
+  
+  for (i = 0; nonblock && i < nouts; i++) {
+    if (!outs[i].opened) {
+      fcntl(outs[i].fd, F_SETFL, outs[i].flags);
+    }
+  }
+}
+
+/**
+ * @brief Open the fan-out outputs.
+ * @param specs The -o and -O arguments in the order given.
+ * @param isfd Non-zero for each spec that names a file descriptor.
+ * @param n The number of specs.
+ */
+static void
+openouts(char **specs, int *isfd, int n)
+{
+  char *ep;
+  long  fd;
+  int   i;
+  
+  if ((outs = calloc(n, sizeof(struct output))) == NULL) {
+    err(1, "calloc");
+  }
+  
+  for (i = 0; i < n; i++) {
+    if (isfd[i]) {
+      errno = 0;
+      fd    = strtol(specs[i], &ep, 10);
+      
+      if (errno || *ep != '\0' || fd < 0 || fd > INT_MAX ||
+          fcntl((int)fd, F_GETFL) < 0)
+      {
+        errx(1, "bad file descriptor: %s", specs[i]);
+      }
+      
+      outs[i].fd = (int)fd;
+    } else {
+      outs[i].fd = open(specs[i], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      
+      if (outs[i].fd < 0) {
+        err(1, "%s", specs[i]);
+      }
+      
+      outs[i].opened = 1;
+    }
+    
+    if (nonblock) {
+      outs[i].flags = fcntl(outs[i].fd, F_GETFL);
+      fcntl(outs[i].fd, F_SETFL, outs[i].flags | O_NONBLOCK);
+    }
+  }
+  
+  nouts = n;
+  
+  /* Inherited descriptors are shared, so put them back even on error. */
+  if (nonblock) {
+    atexit(restoreouts);
+  }
+}
+
+/**
+ * @brief Flush and close the fan-out outputs.
+ */
+static void
+closeouts(void)
+{
+  int i;
+  
+  for (i = 0; i < nouts; i++) {
+    if (outs[i].used && !nofinalnl) {
+      outappend(&outs[i], "\n", 1);
+    }
+    
+    writeall(outs[i].fd, outs[i].buf, outs[i].len);
+    outs[i].len = 0;
+    
+    if (outs[i].opened && close(outs[i].fd) < 0) {
+      err(1, "close");
+    }
+  }
+  
+  restoreouts();
+}
+
+/**
+ * @brief Format some data either to standard output or, when fanning
+ *        out, to the current element buffer.
+ * @param fmt A printf(3) format string.
+ */
+static void
+emitf(const char *fmt, ...)
+{
+  va_list ap;
+  size_t  room;
+  int     n;
+  
+  va_start(ap, fmt);
+  
+  if (nouts == 0) {
+    vprintf(fmt, ap);
+  } else {
+    room = sizeof(elembuf) - elemlen;
+    n    = vsnprintf(elembuf + elemlen, room, fmt, ap);
+    
+    if (n < 0 || (size_t)n >= room) {
+      errx(1, "element too long.");
+    }
+    
+    elemlen += n;
+  }
+  
+  va_end(ap);
+}
+
 /**
  * @brief Put some data to standard output.
  * @param x The data to write.
@@ -157,36 +562,38 @@ int
 putdata(double x, long int notlast)
 {
   if (boring) {
-    printf("%s", format);
+    emitf("%s", format);
   } else if (longdata && nosign) {
     if (x <= (double)ULONG_MAX && x >= (double)0) {
-      printf(format, (unsigned long)x);
+      emitf(format, (unsigned long)x);
     } else {
       return 1;
     }
   } else if (longdata) {
     if (x <= (double)LONG_MAX && x >= (double)LONG_MIN) {
-      printf(format, (long)x);
+      emitf(format, (long)x);
     } else {
       return 1;
     }
   } else if (chardata || (intdata && !nosign)) {
     if (x <= (double)INT_MAX && x >= (double)INT_MIN) {
-      printf(format, (int)x);
+      emitf(format, (int)x);
     } else {
       return 1;
     }
   } else if (intdata) {
     if (x <= (double)UINT_MAX && x >= (double)0) {
-      printf(format, (int)x);
+      emitf(format, (int)x);
     } else {
       return 1;
     }
   } else {
-    printf(format, x);
+    emitf(format, x);
   }
   
-  if (notlast != 0) {
+  if (nouts > 0) {
+    dispatch();
+  } else if (notlast != 0) {
     fputs(sepstring, stdout);
   }
   
@@ -387,8 +794,12 @@ main(int argc, char **argv)
   unsigned int  mask = 0;
   int           n    = 0;
   int           ch;
+  char         *outspec[OUTS_MAX];
+  int           outisfd[OUTS_MAX];
+  int           noutspec = 0;
+  char         *ep;
   
-  while ((ch = getopt(argc, argv, "rb:w:cs:np:")) != -1) {
+  while ((ch = getopt(argc, argv, "rb:w:cs:np:o:O:m:k:N")) != -1) {
     switch (ch) {
       case 'r':
         randomize                                  = 1;
@@ -423,6 +834,40 @@ main(int argc, char **argv)
         }
         break;
         
+      case 'o':
+      case 'O':
+        if (noutspec == OUTS_MAX) {
+          errx(1, "too many outputs.");
+        }
+        
+        outisfd[noutspec]   = (ch == 'O');
+        outspec[noutspec++] = optarg;
+        break;
+        
+      case 'm':
+        if (strcmp(optarg, "rr") == 0) {
+          outmode = MODE_RR;
+        } else if (strcmp(optarg, "block") == 0) {
+          outmode = MODE_BLOCK;
+        } else if (strcmp(optarg, "hash") == 0) {
+          outmode = MODE_HASH;
+        } else {
+          errx(1, "bad distribution mode: %s", optarg);
+        }
+        break;
+        
+      case 'k':
+        errno   = 0;
+        blocksz = strtol(optarg, &ep, 10);
+        if (errno || ep == optarg || *ep != '\0' || blocksz <= 0) {
+          errx(1, "bad block size.");
+        }
+        break;
+        
+      case 'N':
+        nonblock = 1;
+        break;
+        
       default:
         usage();
     }                           /* switch(...) */
@@ -625,6 +1070,15 @@ main(int argc, char **argv)
     infinity = 1;
   }
   
+  if (noutspec > 0) {
+    openouts(outspec, outisfd, noutspec);
+    
+    /* Default to splitting the output into one block per output. */
+    if (blocksz == 0) {
+      blocksz = infinity ? BLOCK_DEF : (reps + nouts - 1) / nouts;
+    }
+  }
+  
   if (randomize) {
     *x = (ender - begin) * (ender > begin ? 1 : -1);
     
@@ -643,7 +1097,9 @@ main(int argc, char **argv)
     }
   }
   
-  if (!nofinalnl) {
+  if (nouts > 0) {
+    closeouts();
+  } else if (!nofinalnl) {
     putchar('\n');
   }
   
@@ -34,86 +34,1899 @@
  */
 /* }}} */
 
+/* Needed for tee(2). */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <math.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <termios.h>
 #include <signal.h>
 #include <locale.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef __linux__
+# include <sys/epoll.h>
+# include <sys/syscall.h>
+# if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+     defined(__NR_io_uring_register)
+#  include <linux/io_uring.h>
+#  define HAVE_URING
+# endif
+#endif
+
+/*
+ * Size of a block read.  This is also the most a single peek on a
+ * socket or pipe will look at.
+ */
+#define BLKSIZE          65536
+
+/*
+ * How an input is read without consuming more than one line.
+ *
+ *   IN_MMAP  - Regular files: map a window of the file from the
+ *              current offset, then seek to just past the terminator.
+ *   IN_SEEK  - Block devices and unmappable regular files: read a
+ *              block, then seek back to just past the terminator.
+ *   IN_SOCK  - Stream sockets: peek with MSG_PEEK, then consume the
+ *              line.
+ *   IN_PIPE  - Pipes and FIFOs: peek with tee(2) into a private pipe,
+ *              then consume the line.
+ *   IN_MSG   - Datagram and packet sockets: a whole message at a
+ *              time, since part of one cannot be left to be read.
+ *   IN_BYTE  - Everything else (terminals, etc): one byte at a time.
+ */
+#define IN_SEEK          0
+#define IN_SOCK          1
+#define IN_PIPE          2
+#define IN_BYTE          3
+#define IN_MMAP          4
+#define IN_MSG           5
+
+/* Count a system call made while reading, for the statistics. */
+#define SYS(call)        (stats.calls++, (call))
+
+/* Largest window of a regular file mapped at once. */
+#define MAPSIZE          (8 * 1024 * 1024)
+
+/*
+ * First chunk of the line arena.  Longer lines grow it by doubling;
+ * what is beyond this is given back once a long line is done with.
+ */
+#define ARENA_MIN        (64 * 1024)
+
+/* What `waitFill' returns when a timeout expires. */
+#define FILL_TIMEOUT     -2
+
+/* Exit statuses. */
+#define EXIT_EOF         1         /* End of file or read error. */
+#define EXIT_USAGE       2         /* Bad arguments. */
+#define EXIT_LONG        3         /* A line was too long (-C). */
+#define EXIT_TIMEOUT     124       /* A timeout expired (as timeout(1)). */
+
+#define INPUTS_MAX       64        /* Most inputs that can be waited on. */
+#define REQ_MAX          4096      /* Longest server request. */
+#define DELIM_MAX        64        /* Longest record delimiter. */
+
+typedef struct {
+  const char *name;                /* Name given on the command line. */
+  int fd;                          /* The input file descriptor. */
+  int kind;                        /* One of the IN_* read methods. */
+  int peek[2];                     /* Private pipe used by IN_PIPE. */
+  char *map;                       /* Window mapped by IN_MMAP. */
+  size_t maplen;                   /* Length of the window. */
+  off_t off;                       /* File offset, for IN_MMAP. */
+} input;
 
 static int status;                 /* Exit status. */
-static int timeout = -1;           /* Timeout value. */
+static double timeout = -1;        /* Overall timeout (-t), seconds. */
+static double idle = -1;           /* Inter-byte timeout (-i), seconds. */
+static long long deadline = -1;    /* When -t expires, in ms. */
+static long long lastByte;         /* When input last arrived, in ms. */
+static long count = 1;             /* Lines to read (-n), 0 for all. */
+static int shellOut;               /* Emit shell assignments (-s). */
+static const char *prefix = "L";   /* Variable name prefix (-p). */
+static const char *delims;         /* Field delimiters (-F). */
+static char delim[DELIM_MAX];      /* Record delimiter (-d/-z). */
+static size_t dlen;                /* Its length, 0 for CR or NL. */
+static char outTerm = '\n';        /* Written after each line. */
+static int outPipe;                /* Standard output is a pipe. */
+static int useUring;               /* Wait with io_uring (-e uring). */
+
+/*
+ * Statistics, reported on exit when LINE_STATS is set in the
+ * environment.  Times are in microseconds.
+ */
+static struct {
+  int on;                          /* Keeping the times. */
+  long long start;                 /* When we started. */
+  long long first;                 /* When data first arrived. */
+  long long last;                  /* When data last arrived. */
+  long long maxGap;                /* Longest wait between data. */
+  unsigned long long bytes;        /* Bytes consumed. */
+  unsigned long calls;             /* System calls made reading. */
+} stats;
+
+static const char *source;         /* Name to prefix lines with. */
+static long linesRead;             /* Lines read so far. */
+static int partial;                /* Current line has data. */
+static char *linebuf;              /* Current line, for -s. */
+static size_t linelen;             /* Length of `linebuf'. */
+static size_t linesize;            /* Mapped size of `linebuf'. */
+static size_t maxBytes;            /* Longest line kept, 0 for any. */
+static int failLong;               /* Fail rather than truncate (-C). */
+static size_t thisLen;             /* Length of the line so far. */
+static int tooLong;                /* The line went over `maxBytes'. */
+
+static int serving;                /* Running as a server (-S/-L). */
+static int outfd = STDOUT_FILENO;  /* Where output goes. */
+static int outError;               /* A server client went away. */
+
+static unsigned char isDelim[256]; /* Table of field delimiters. */
+static int collapse;               /* Delimiters are all whitespace. */
+
+static char inbuf[BLKSIZE];        /* Input block. */
+static char outbuf[BLKSIZE];       /* Pending output. */
+static size_t outlen;              /* Bytes pending in `outbuf'. */
+
+/*
+ * Purpose:   Read the monotonic clock.
+ * Arguments: None.
+ * Returns:   The time in milliseconds.
+ */
+static long long
+nowMs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Purpose:   Read the monotonic clock.
+ * Arguments: None.
+ * Returns:   The time in microseconds.
+ */
+static long long
+nowUs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Purpose:   Note that data have arrived, for the statistics.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+noteData(void)
+{
+  long long now;
+
+  if (!stats.on)
+    return;
+
+  now = nowUs();
+  if (stats.first == 0)
+    stats.first = now;
+  else if (now - stats.last > stats.maxGap)
+    stats.maxGap = now - stats.last;
+  stats.last = now;
+}
+
+/*
+ * Purpose:   Write the statistics out as a single line, to stderr or
+ *            appended to the file named by LINE_STATS.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+reportStats(void)
+{
+  const char *path = getenv("LINE_STATS");
+  char rec[256];
+  long long end = nowUs();
+  int fd = STDERR_FILENO, n;
+
+  n = snprintf(rec, sizeof(rec),
+               "line: ttfb_us=%lld read_us=%lld bytes=%llu syscalls=%lu "
+               "max_gap_us=%lld timeout=%d status=%d\n",
+               stats.first ? stats.first - stats.start : -1LL,
+               end - stats.start,
+               stats.bytes,
+               stats.calls,
+               stats.maxGap,
+               status == EXIT_TIMEOUT,
+               status);
+
+  if (*path != '\0' && strcmp(path, "1") != 0 && strcmp(path, "-") != 0 &&
+      (fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666)) < 0)
+    return;
+
+  write(fd, rec, n);
+
+  if (fd != STDERR_FILENO)
+    close(fd);
+}
+
+/*
+ * Purpose:   Parse a timeout given in (possibly fractional) seconds.
+ *            Timeouts are kept to what fits in an int of milliseconds.
+ * Arguments: str - The string to parse.
+ * Returns:   The timeout in seconds, or -1 if it is not valid.
+ */
+static double
+parseSecs(const char *str)
+{
+  char *end;
+  double secs;
+
+  secs = strtod(str, &end);
+  if (end == str || *end != '\0' || !isfinite(secs) || secs < 0)
+    return -1;
+
+  if (secs > INT_MAX / 1000.0)
+    secs = INT_MAX / 1000.0;
+
+  return secs;
+}
+
+/*
+ * Purpose:   Parse a file descriptor number.
+ * Arguments: str - The string to parse.
+ * Returns:   The file descriptor, or -1 if it is not valid.
+ */
+static int
+parseFd(const char *str)
+{
+  char *end;
+  long fd;
+
+  if (!isdigit((unsigned char)*str))
+    return -1;
+
+  errno = 0;
+  fd = strtol(str, &end, 10);
+  if (*end != '\0' || errno != 0 || fd > INT_MAX)
+    return -1;
+
+  return (int)fd;
+}
+
+/*
+ * Purpose:   Write a buffer out in its entirety.
+ * Arguments: buf - The data to write.
+ *            len - The length of the data.
+ * Returns:   Nothing.
+ */
+static void
+writeAll(const char *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0 && !outError) {
+    if ((n = SYS(write(outfd, buf, len))) < 0) {
+      if (errno == EINTR)
+        continue;
+
+      /* A server outlives its clients. */
+      if (serving) {
+        outError = 1;
+        return;
+      }
+
+      perror("write");
+      exit(EXIT_FAILURE);
+    }
+
+    buf += n;
+    len -= n;
+  }
+}
+
+/*
+ * Purpose:   Flush any pending output.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+flushOut(void)
+{
+  writeAll(outbuf, outlen);
+  outlen = 0;
+}
+
+/*
+ * Purpose:   Queue some data for output.
+ * Arguments: buf - The data.
+ *            len - The length of the data.
+ * Returns:   Nothing.
+ */
+static void
+putOut(const char *buf, size_t len)
+{
+  if (len > sizeof(outbuf) - outlen) {
+    flushOut();
+
+    /* Too big to be worth buffering. */
+    if (len >= sizeof(outbuf)) {
+      writeAll(buf, len);
+      return;
+    }
+  }
+
+  memcpy(outbuf + outlen, buf, len);
+  outlen += len;
+}
+
+/*
+ * Purpose:   Queue some data for output with backslashes and newlines
+ *            escaped, so that it fits on one line.
+ * Arguments: buf - The data.
+ *            len - The length of the data.
+ * Returns:   Nothing.
+ */
+static void
+putEscaped(const char *buf, size_t len)
+{
+  size_t i, start = 0;
+
+  for (i = 0; i < len; i++) {
+    if (buf[i] != '\\' && buf[i] != '\n')
+      continue;
+    putOut(buf + start, i - start);
+    putOut(buf[i] == '\n' ? "\\n" : "\\\\", 2);
+    start = i + 1;
+  }
+  putOut(buf + start, len - start);
+}
+
+/*
+ * Purpose:   Work out how an input can be read.
+ * Arguments: in   - The input.
+ *            fd   - The file descriptor.
+ *            name - The name to report the input as.
+ * Returns:   Nothing.
+ */
+static void
+openInput(input *in, int fd, const char *name)
+{
+  struct stat st;
+  socklen_t optlen = sizeof(int);
+  int type;
+
+  in->name = name;
+  in->fd = fd;
+  in->kind = IN_BYTE;
+  in->peek[0] = in->peek[1] = -1;
+  in->map = NULL;
+
+  if (fstat(fd, &st) < 0)
+    return;
+
+  if (S_ISREG(st.st_mode) &&
+      (in->off = lseek(fd, 0, SEEK_CUR)) != (off_t)-1)
+  {
+    in->kind = IN_MMAP;
+  } else if (S_ISSOCK(st.st_mode)) {
+    /*
+     * Consuming part of a peeked datagram or packet would throw the
+     * rest of it away, so only a byte stream can be peeked at.
+     */
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &optlen) < 0)
+      return;
+    in->kind = (type == SOCK_STREAM) ? IN_SOCK : IN_MSG;
+  } else if (S_ISFIFO(st.st_mode)) {
+#ifdef __linux__
+    if (pipe(in->peek) == 0)
+      in->kind = IN_PIPE;
+#endif
+  } else if (S_ISBLK(st.st_mode) && lseek(fd, 0, SEEK_CUR) != (off_t)-1) {
+    /*
+     * Character devices such as /dev/urandom accept a seek and ignore
+     * it, so only block devices are trusted to seek back.
+     */
+    in->kind = IN_SEEK;
+  }
+}
+
+/*
+ * Purpose:   Release anything held by an input.
+ * Arguments: in - The input.
+ * Returns:   Nothing.
+ */
+static void
+closeInput(input *in)
+{
+  if (in->map != NULL)
+    munmap(in->map, in->maplen);
+
+  if (in->peek[0] != -1) {
+    close(in->peek[0]);
+    close(in->peek[1]);
+  }
+}
+
+/*
+ * Purpose:   Work out how long to wait for input.
+ * Arguments: None.
+ * Returns:   The time left before a timeout expires in ms, or -1 if
+ *            there is no timeout.
+ */
+static int
+waitMs(void)
+{
+  long long now, wait = -1, left;
+
+  now = nowMs();
+
+  /* Wait for whichever timeout expires first. */
+  if (deadline >= 0)
+    wait = (deadline > now) ? deadline - now : 0;
+
+  if (idle >= 0) {
+    left = lastByte + (long long)(idle * 1000) - now;
+    if (left < 0)
+      left = 0;
+    if (wait < 0 || left < wait)
+      wait = left;
+  }
+
+  return (int)wait;
+}
+
+/*
+ * Purpose:   Wait for input to become available within the timeouts.
+ * Arguments: in - The input.
+ * Returns:   1 if input is ready, 0 if a timeout expired.
+ */
+static int
+waitInput(input *in)
+{
+  struct pollfd pfd;
+  int r;
+
+  pfd.fd = in->fd;
+  pfd.events = POLLIN;
+
+  for (;;) {
+    if ((r = SYS(poll(&pfd, 1, waitMs()))) > 0)
+      return 1;
+
+    if (r == 0)
+      return 0;
+
+    if (errno != EINTR) {
+      /* Let the read report the problem. */
+      return 1;
+    }
+  }
+}
+
+/*
+ * Purpose:   Map the next window of a regular file.
+ * Arguments: in   - The input.
+ *            bufp - Set to the start of the data.
+ * Returns:   The number of bytes, 0 on EOF or -1 on error.
+ */
+static ssize_t
+mapBlock(input *in, char **bufp)
+{
+  static long pagesize;
+  struct stat st;
+  off_t start;
+  size_t len;
+  char *map;
+
+  if (pagesize == 0)
+    pagesize = sysconf(_SC_PAGESIZE);
+
+  if (in->map != NULL) {
+    SYS(munmap(in->map, in->maplen));
+    in->map = NULL;
+  }
+
+  if (SYS(fstat(in->fd, &st)) < 0)
+    return -1;
+
+  if (in->off >= st.st_size)
+    return 0;
+
+  /* Mappings have to start on a page boundary. */
+  start = in->off & ~(off_t)(pagesize - 1);
+  len = (st.st_size - start > MAPSIZE) ? MAPSIZE : st.st_size - start;
+
+  map = SYS(mmap(NULL, len, PROT_READ, MAP_SHARED, in->fd, start));
+  if (map == MAP_FAILED) {
+    /* Some files cannot be mapped, so just read them. */
+    in->kind = IN_SEEK;
+    return SYS(read(in->fd, *bufp, BLKSIZE));
+  }
+
+  SYS(madvise(map, len, MADV_SEQUENTIAL));
+
+  in->map = map;
+  in->maplen = len;
+  *bufp = map + (in->off - start);
+
+  return len - (in->off - start);
+}
+
+#ifdef __linux__
+/*
+ * Purpose:   Read back what was duplicated into an input's private
+ *            pipe.
+ * Arguments: in  - The input.
+ *            buf - Where to put the data.
+ *            len - How much was duplicated.
+ * Returns:   `len', or -1 on error.
+ */
+static ssize_t
+readPeek(input *in, char *buf, size_t len)
+{
+  size_t got;
+  ssize_t r;
+
+  for (got = 0; got < len; got += r) {
+    if ((r = SYS(read(in->peek[0], buf + got, len - got))) <= 0) {
+      if (r < 0 && errno == EINTR) {
+        r = 0;
+        continue;
+      }
+      return -1;
+    }
+  }
+
+  return len;
+}
+#endif
+
+/*
+ * Purpose:   Obtain the next block of input.  Except for IN_SEEK,
+ *            IN_MSG and IN_BYTE, the data are not consumed until
+ *            `consume' is called.
+ * Arguments: in   - The input.
+ *            bufp - The buffer to fill.  Set to the data instead if
+ *                   they can be used where they are.
+ *            len  - The size of the buffer.
+ * Returns:   The number of bytes, 0 on EOF or -1 on error.
+ */
+static ssize_t
+fillBlock(input *in, char **bufp, size_t len)
+{
+  char *buf = *bufp;
+  ssize_t n;
+
+  switch (in->kind) {
+  case IN_MMAP:
+    return mapBlock(in, bufp);
+
+  case IN_SEEK:
+  case IN_MSG:
+    return SYS(read(in->fd, buf, len));
+
+  case IN_SOCK:
+    return SYS(recv(in->fd, buf, len, MSG_PEEK));
+
+#ifdef __linux__
+  case IN_PIPE:
+    /* Duplicate what is in the pipe, then read the duplicate. */
+    if ((n = SYS(tee(in->fd, in->peek[1], len, 0))) <= 0)
+      return n;
+
+    return readPeek(in, buf, n);
+#endif
+
+  default:
+    return SYS(read(in->fd, buf, 1));
+  }
+}
+
+/*
+ * Purpose:   Consume `used' bytes of the `len' bytes returned by the
+ *            last `fillBlock', leaving the rest for the next reader.
+ * Arguments: in   - The input.
+ *            buf  - The buffer passed to `fillBlock'.
+ *            used - The number of bytes to consume.
+ *            len  - The number of bytes `fillBlock' returned.
+ * Returns:   0 on success, -1 on error.
+ */
+static int
+consume(input *in, char *buf, size_t used, size_t len)
+{
+  ssize_t r;
+
+  switch (in->kind) {
+  case IN_MMAP:
+    in->off += used;
+    if (SYS(lseek(in->fd, in->off, SEEK_SET)) == (off_t)-1)
+      return -1;
+    return 0;
+
+  case IN_SEEK:
+    if (used < len &&
+        SYS(lseek(in->fd, -(off_t)(len - used), SEEK_CUR)) == (off_t)-1)
+      return -1;
+    return 0;
+
+  case IN_SOCK:
+  case IN_PIPE:
+    /*
+     * The bytes read here are the very bytes already in `buf', so
+     * they can safely be read over the top of it.
+     */
+    while (used > 0) {
+      if ((r = SYS(read(in->fd, buf, used))) <= 0) {
+        if (r < 0 && errno == EINTR)
+          continue;
+        return -1;
+      }
+      buf += r;
+      used -= r;
+    }
+    return 0;
+
+  default:
+    return 0;
+  }
+}
+
+#ifdef HAVE_URING
+/*
+ * The io_uring engine (-e uring).  Waiting for input and peeking at
+ * it become a single request with a timeout linked to it, so a timed
+ * read costs one system call rather than a poll(2) and a read.  Only
+ * the submission and completion rings are used, so no library is
+ * needed.
+ */
+static struct {
+  int fd;                          /* The ring, or -1. */
+  unsigned *sqHead;                /* Submission queue head. */
+  unsigned *sqTail;                /* Submission queue tail. */
+  unsigned *sqMask;                /* Submission queue index mask. */
+  unsigned *sqArray;               /* Submission queue indices. */
+  struct io_uring_sqe *sqes;       /* Submission queue entries. */
+  unsigned *cqHead;                /* Completion queue head. */
+  unsigned *cqTail;                /* Completion queue tail. */
+  unsigned *cqMask;                /* Completion queue index mask. */
+  struct io_uring_cqe *cqes;       /* Completion queue entries. */
+} ring = { -1 };
+
+/*
+ * Purpose:   Check that the kernel knows every operation the engine
+ *            uses.  Kernels from before 5.8 have io_uring but lack some
+ *            of them, and those before 5.6 cannot be asked at all.
+ * Arguments: fd - The ring.
+ * Returns:   0 if all are there, -1 if not.
+ */
+static int
+uringProbe(int fd)
+{
+  static const int ops[] = {
+    IORING_OP_POLL_ADD, IORING_OP_TEE, IORING_OP_RECV, IORING_OP_READ,
+    IORING_OP_LINK_TIMEOUT
+  };
+  struct io_uring_probe *probe;
+  size_t i;
+  int rc = 0;
+
+  probe = calloc(1, sizeof(*probe) +
+                    IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+  if (probe == NULL ||
+      syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+              IORING_OP_LAST) < 0)
+    rc = -1;
+
+  for (i = 0; rc == 0 && i < sizeof(ops) / sizeof(ops[0]); i++)
+    if (ops[i] > probe->last_op ||
+        !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+      rc = -1;
+
+  free(probe);
+  return rc;
+}
+
+/*
+ * Purpose:   Set up the ring.
+ * Arguments: None.
+ * Returns:   0 on success, -1 if io_uring cannot be used.
+ */
+static int
+uringInit(void)
+{
+  struct io_uring_params p;
+  size_t sqLen, cqLen;
+  char *sq, *cq;
+  void *sqes;
+  int fd;
+
+  memset(&p, 0, sizeof(p));
+  if ((fd = syscall(__NR_io_uring_setup, 4, &p)) < 0)
+    return -1;
+
+  if (uringProbe(fd) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  /* Newer kernels map both rings at once. */
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cqLen > sqLen)
+      sqLen = cqLen;
+    cqLen = sqLen;
+  }
+
+  sq = mmap(NULL, sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  cq = sq;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = mmap(NULL, cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+      munmap(sq, sqLen);
+      close(fd);
+      return -1;
+    }
+  }
+
+  sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    munmap(sq, sqLen);
+    if (cq != sq)
+      munmap(cq, cqLen);
+    close(fd);
+    return -1;
+  }
+
+  ring.sqHead = (unsigned *)(sq + p.sq_off.head);
+  ring.sqTail = (unsigned *)(sq + p.sq_off.tail);
+  ring.sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring.sqArray = (unsigned *)(sq + p.sq_off.array);
+  ring.sqes = sqes;
+  ring.cqHead = (unsigned *)(cq + p.cq_off.head);
+  ring.cqTail = (unsigned *)(cq + p.cq_off.tail);
+  ring.cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  ring.fd = fd;
+
+  return 0;
+}
+
+/*
+ * Purpose:   Queue a request on the ring.
+ * Arguments: None.
+ * Returns:   The entry to fill in, already cleared.
+ */
+static struct io_uring_sqe *
+uringGet(void)
+{
+  unsigned tail = *ring.sqTail;
+  unsigned idx = tail & *ring.sqMask;
+  struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  ring.sqArray[idx] = idx;
+  __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+
+  return sqe;
+}
+
+/*
+ * Purpose:   Link a timeout to a queued request, if there is one.
+ * Arguments: sqe  - The request.
+ *            ts   - Where to keep the timeout.
+ *            wait - The timeout in ms, or -1 for none.
+ * Returns:   The last request queued.
+ */
+static struct io_uring_sqe *
+uringTimeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts, int wait)
+{
+  if (wait < 0)
+    return sqe;
+
+  ts->tv_sec = wait / 1000;
+  ts->tv_nsec = (wait % 1000) * 1000000L;
+
+  sqe->flags |= IOSQE_IO_LINK;
+  sqe = uringGet();
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->addr = (unsigned long)ts;
+  sqe->len = 1;
+  sqe->user_data = 2;
+
+  return sqe;
+}
+
+/*
+ * Purpose:   Wait for input and peek at it in a single submission,
+ *            bounded by the timeouts.
+ * Arguments: in  - The input.
+ *            buf - The buffer to fill.
+ *            len - The size of the buffer.
+ * Returns:   The number of bytes, 0 on EOF, -1 on error or
+ *            FILL_TIMEOUT if a timeout expired.
+ */
+static ssize_t
+uringFill(input *in, char *buf, size_t len)
+{
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  struct __kernel_timespec ts;
+  unsigned head, tail, want, got, submit;
+  int res, r;
+
+again:
+  tail = *ring.sqTail;
+  sqe = uringGet();
+
+  switch (in->kind) {
+  case IN_SOCK:
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = in->fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_PEEK;
+    sqe->user_data = 1;
+    uringTimeout(sqe, &ts, waitMs());
+    break;
+
+  case IN_PIPE:
+    /*
+     * A tee(2) blocked on an empty pipe cannot be cancelled, so the
+     * timeout is put on a poll and the tee is chained after that.
+     */
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = in->fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = 3;
+    sqe = uringTimeout(sqe, &ts, waitMs());
+
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe = uringGet();
+    sqe->opcode = IORING_OP_TEE;
+    sqe->splice_fd_in = in->fd;
+    sqe->fd = in->peek[1];
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_NONBLOCK;
+    sqe->user_data = 1;
+    break;
+
+  default:
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = in->fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = (in->kind == IN_MSG) ? len : 1;
+    sqe->off = (__u64)-1;
+    sqe->user_data = 1;
+    uringTimeout(sqe, &ts, waitMs());
+    break;
+  }
+
+  /* Every request queued completes, one way or another. */
+  submit = want = *ring.sqTail - tail;
+  got = 0;
+  res = 0;
+
+  while (got < want) {
+    r = SYS(syscall(__NR_io_uring_enter, ring.fd, submit, want - got,
+                    IORING_ENTER_GETEVENTS, NULL, 0));
+    if (r < 0 && errno != EINTR)
+      return -1;
+    if (r > 0)
+      submit -= r;
+
+    head = *ring.cqHead;
+    while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)) {
+      cqe = &ring.cqes[head & *ring.cqMask];
+      if (cqe->user_data == 1)
+        res = cqe->res;
+      got++;
+      head++;
+    }
+    __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+  }
+
+  /* The pipe was ready but someone else emptied it. */
+  if (res == -EAGAIN)
+    goto again;
+
+  if (res == -ECANCELED)
+    return FILL_TIMEOUT;
+
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+
+  if (in->kind == IN_PIPE && res > 0)
+    return readPeek(in, buf, res);
+
+  return res;
+}
+#endif
+
+/*
+ * Purpose:   Wait for the next block of input within the timeouts,
+ *            then obtain it as `fillBlock' does.
+ * Arguments: in   - The input.
+ *            bufp - The buffer to fill, or set to the data.
+ *            len  - The size of the buffer.
+ * Returns:   The number of bytes, 0 on EOF, -1 on error or
+ *            FILL_TIMEOUT if a timeout expired.
+ */
+static ssize_t
+waitFill(input *in, char **bufp, size_t len)
+{
+  if (timeout < 0 && idle < 0)
+    return fillBlock(in, bufp, len);
+
+#ifdef HAVE_URING
+  /* Files are always ready, so only the others are worth a ring. */
+  if (useUring && in->kind != IN_MMAP && in->kind != IN_SEEK)
+    return uringFill(in, *bufp, len);
+#endif
+
+  if (!waitInput(in))
+    return FILL_TIMEOUT;
+
+  return fillBlock(in, bufp, len);
+}
+
+/*
+ * Purpose:   Find the first line terminator in a buffer.  Without a
+ *            delimiter this is the first CR or NL.
+ * Arguments: buf - The buffer.
+ *            len - The length of the buffer.
+ * Returns:   The terminator, or NULL if there is none.
+ */
+static char *
+scanEOL(char *buf, size_t len)
+{
+  char *nl, *cr;
+
+  if (dlen == 1)
+    return memchr(buf, delim[0], len);
+
+  if (dlen > 1)
+    return memmem(buf, len, delim, dlen);
+
+  if ((nl = memchr(buf, '\n', len)) != NULL)
+    len = nl - buf;
+
+  if ((cr = memchr(buf, '\r', len)) != NULL)
+    return cr;
+
+  return nl;
+}
+
+/*
+ * Purpose:   Decode C-style escapes (\n, \r, \t, \0, \\ and \xHH).
+ * Arguments: dest - Where to put the result.
+ *            size - The size of `dest'.
+ *            src  - The string to decode.
+ * Returns:   The length of the result, or 0 if it is empty or too
+ *            long.
+ */
+static size_t
+unescape(char *dest, size_t size, const char *src)
+{
+  size_t len = 0;
+  int n;
+  char ch;
+
+  while (*src != '\0') {
+    ch = *src++;
+
+    if (ch == '\\' && *src != '\0') {
+      switch ((ch = *src++)) {
+      case 'n': ch = '\n'; break;
+      case 'r': ch = '\r'; break;
+      case 't': ch = '\t'; break;
+      case '0': ch = '\0'; break;
+      case 'x':
+        for (n = 0, ch = 0; n < 2 && isxdigit((unsigned char)*src); n++)
+          ch = ch * 16 + (isdigit((unsigned char)*src) ?
+                          *src++ - '0' : tolower(*src++) - 'a' + 10);
+        break;
+      default:
+        break;
+      }
+    }
+
+    if (len == size)
+      return 0;
+    dest[len++] = ch;
+  }
+
+  return len;
+}
+
+/*
+ * Purpose:   Set up the field delimiter table.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+initDelims(void)
+{
+  const unsigned char *p;
+
+  /* Default to splitting like the shell does. */
+  if (delims == NULL && (delims = getenv("IFS")) == NULL)
+    delims = " \t\n";
+
+  /* Whitespace delimiters collapse, as with IFS. */
+  collapse = 1;
+  for (p = (const unsigned char *)delims; *p != '\0'; p++) {
+    isDelim[*p] = 1;
+    if (*p != ' ' && *p != '\t' && *p != '\n')
+      collapse = 0;
+  }
+}
+
+/*
+ * Purpose:   Find the next field delimiter.
+ * Arguments: buf - The buffer.
+ *            len - The length of the buffer.
+ * Returns:   The delimiter, or NULL if there is none.
+ */
+static const char *
+scanDelim(const char *buf, size_t len)
+{
+  const char *end = buf + len;
+
+  /* A single delimiter gets the library's vectorised search. */
+  if (delims[0] != '\0' && delims[1] == '\0')
+    return memchr(buf, delims[0], len);
+
+  for (; buf < end; buf++)
+    if (isDelim[(unsigned char)*buf])
+      return buf;
+
+  return NULL;
+}
+
+/*
+ * Purpose:   Queue a single-quoted copy of a string for output.
+ * Arguments: str - The string.
+ *            len - The length of the string.
+ * Returns:   Nothing.
+ */
+static void
+putQuoted(const char *str, size_t len)
+{
+  const char *q;
+
+  putOut("'", 1);
+
+  while ((q = memchr(str, '\'', len)) != NULL) {
+    putOut(str, q - str);
+    putOut("'\\''", 4);
+    len -= q - str + 1;
+    str = q + 1;
+  }
+
+  putOut(str, len);
+  putOut("'\n", 2);
+}
+
+/*
+ * Purpose:   Queue a shell variable name for output.
+ * Arguments: fmt   - A printf format taking the prefix, line number
+ *                    and field number.
+ *            line  - The line number.
+ *            field - The field number.
+ * Returns:   Nothing.
+ */
+static void
+putName(const char *fmt, long line, long field)
+{
+  char name[128];
+  int n;
+
+  n = snprintf(name, sizeof(name), fmt, prefix, line, field);
+  if (n < 0 || (size_t)n >= sizeof(name))
+    n = sizeof(name) - 1;
+
+  putOut(name, n);
+}
+
+/*
+ * Purpose:   Queue the shell assignments for the current line.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+putAssign(void)
+{
+  const char *p = linebuf, *end = linebuf + linelen, *d;
+  long nf = 0;
+
+  putName("%s%ld=", linesRead, 0);
+  putQuoted(linebuf, linelen);
+
+  /* Split the line into fields. */
+  while (p < end || (!collapse && p == end && nf > 0)) {
+    if (collapse) {
+      while (p < end && isDelim[(unsigned char)*p])
+        p++;
+      if (p == end)
+        break;
+    }
+
+    if (delims[0] == '\0' || (d = scanDelim(p, end - p)) == NULL)
+      d = end;
+
+    putName("%s%ld_F%ld=", linesRead, ++nf);
+    putQuoted(p, d - p);
+
+    if (d == end)
+      break;
+    p = d + 1;
+  }
+
+  putName("%s%ld_NF=", linesRead, 0);
+  {
+    char num[32];
+    int n = snprintf(num, sizeof(num), "%ld\n", nf);
+
+    putOut(num, n);
+  }
+}
 
 /*
- * Purpose:   Signal handler for timeout and interrupt.
- * Arguments: signum - The signal number.
+ * Purpose:   Queue the name of the input a line came from.
+ * Arguments: None.
  * Returns:   Nothing.
  */
 static void
-handler(int signum)
+putSource(void)
 {
+  if (source != NULL && !shellOut && !partial) {
+    putOut(source, strlen(source));
+    putOut(":", 1);
+  }
 }
 
 /*
- * Purpose:   Read a line in from a given file descriptor.
- * Arguments: fd - The file descriptor to read from.
+ * Purpose:   Make room for a line of a given length.  The line is kept
+ *            in an anonymous mapping that is grown with mremap(2), so
+ *            what has been read is never copied.
+ * Arguments: need - The length needed.
  * Returns:   Nothing.
  */
 static void
-doline(int fd)
+arenaGrow(size_t need)
 {
-  char ch;
-  struct sigaction act;
+  size_t size = (linesize == 0) ? ARENA_MIN : linesize;
+  char *p;
 
-  /* Clear the memory for the signal action. */
-  memset(&act, 0, sizeof(act));
+  while (size < need)
+    size *= 2;
 
-  /* Flush stdout */
-  fflush(stdout);
+  if (linebuf == NULL) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  } else {
+#ifdef __linux__
+    p = mremap(linebuf, linesize, size, MREMAP_MAYMOVE);
+#else
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p != MAP_FAILED) {
+      memcpy(p, linebuf, linelen);
+      munmap(linebuf, linesize);
+    }
+#endif
+  }
+
+  if (p == MAP_FAILED) {
+    perror("line");
+    exit(EXIT_FAILURE);
+  }
+
+  linebuf = p;
+  linesize = size;
+}
+
+/*
+ * Purpose:   Empty the line arena once its line has been written out,
+ *            giving back the memory a long line needed.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+arenaReset(void)
+{
+  if (linelen > ARENA_MIN)
+    madvise(linebuf + ARENA_MIN, linesize - ARENA_MIN, MADV_DONTNEED);
+
+  linelen = 0;
+}
+
+/*
+ * Purpose:   Handle part of a line.  Anything beyond `maxBytes' is
+ *            dropped, or with -C is left unread.
+ * Arguments: buf - The data.
+ *            len - The length of the data.
+ * Returns:   The number of bytes used, which is less than `len' only
+ *            if the line is too long and -C was given.
+ */
+static size_t
+linePiece(const char *buf, size_t len)
+{
+  size_t room, used = len;
+
+  if (len == 0)
+    return 0;
+
+  putSource();
+  partial = 1;
+
+  if (maxBytes > 0 && thisLen + len > maxBytes) {
+    room = (thisLen < maxBytes) ? maxBytes - thisLen : 0;
+    if (failLong) {
+      tooLong = 1;
+      status = EXIT_LONG;
+      used = room;
+    }
+    thisLen += used;
+    len = room;
+  } else {
+    thisLen += len;
+  }
+
+  if (!shellOut && !serving) {
+    putOut(buf, len);
+    return used;
+  }
+
+  if (linelen + len > linesize)
+    arenaGrow(linelen + len);
+
+  memcpy(linebuf + linelen, buf, len);
+  linelen += len;
+
+  return used;
+}
+
+/*
+ * Purpose:   Handle the end of a line.
+ * Arguments: in - The input the line came from.
+ * Returns:   Nothing.
+ */
+static void
+lineEnd(input *in)
+{
+  putSource();
+  linesRead++;
+  partial = 0;
+  thisLen = 0;
+
+  if (shellOut) {
+    putAssign();
+    arenaReset();
+  } else if (!serving) {
+    putOut(&outTerm, 1);
+  }
 
+  /* Someone is probably typing, so do not sit on their lines. */
+  if (in->kind == IN_BYTE)
+    flushOut();
+}
+
+/*
+ * Purpose:   Finish off the output once reading has stopped.
+ * Arguments: in - The input that was read.
+ * Returns:   Nothing.
+ */
+static void
+finish(input *in)
+{
   /*
-   * If a timeout is given and is above zero, then we should
-   * $initialize the signal handler and start the alarm countdown.
+   * Finish off an unterminated line.  Something is always written
+   * unless a shell assignment was asked for.
    */
-  if (timeout > 0) {
-    act.sa_handler = handler;
-    if (sigaction(SIGALRM, &act, NULL) == -1) {
-      perror("sigaction");
-      exit(EXIT_FAILURE);
+  if (partial || (linesRead == 0 && !shellOut))
+    lineEnd(in);
+
+  if (shellOut) {
+    if (source != NULL) {
+      putName("%s_SOURCE=", 0, 0);
+      putQuoted(source, strlen(source));
+    }
+
+    putName("%s_COUNT=", 0, 0);
+    {
+      char num[32];
+      int len = snprintf(num, sizeof(num), "%ld\n", linesRead);
+
+      putOut(num, len);
     }
-    alarm(timeout);
   }
 
-  /* Read in the line. */
+  flushOut();
+}
+
+/*
+ * Purpose:   Look for a multi-byte delimiter that started in the held
+ *            back tail of the last block and ends in this one.
+ * Arguments: in    - The input.
+ *            carry - The held back bytes.
+ *            clen  - The number held back.
+ *            buf   - The new block.
+ *            len   - The length of the new block.
+ * Returns:   The number of bytes of `buf' used up, including all of
+ *            them if they were held back in turn.
+ */
+static size_t
+joinCarry(input *in, char *carry, size_t *clen, const char *buf, size_t len)
+{
+  char join[DELIM_MAX * 2];
+  size_t take, jlen, keep;
+  char *m;
+
+  take = (len < dlen - 1) ? len : dlen - 1;
+  memcpy(join, carry, *clen);
+  memcpy(join + *clen, buf, take);
+  jlen = *clen + take;
+
+  m = memmem(join, jlen, delim, dlen);
+  if (m != NULL && (size_t)(m - join) < *clen) {
+    linePiece(join, m - join);
+    lineEnd(in);
+    take = m - join + dlen - *clen;
+    *clen = 0;
+    return take;
+  }
+
+  /* The delimiter might still straddle the next block. */
+  if (take < dlen - 1) {
+    keep = (jlen < dlen - 1) ? jlen : dlen - 1;
+    linePiece(join, jlen - keep);
+    memmove(carry, join + jlen - keep, keep);
+    *clen = keep;
+    return len;
+  }
+
+  linePiece(carry, *clen);
+  *clen = 0;
+  return 0;
+}
+
+#ifdef __linux__
+/*
+ * Purpose:   Move bytes straight from an input pipe to the output pipe
+ *            with splice(2), without copying them through user space.
+ * Arguments: in  - The input.
+ *            buf - Where the same bytes were peeked into, in case
+ *                  splice(2) cannot be used.
+ *            len - The number of bytes to move.
+ * Returns:   0 on success, -1 on error.
+ */
+static int
+spliceOut(input *in, char *buf, size_t len)
+{
+  ssize_t n;
+
+  flushOut();
+
+  while (len > 0) {
+    n = SYS(splice(in->fd, NULL, outfd, NULL, len, SPLICE_F_MOVE));
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n <= 0) {
+      /* Fall back to copying. */
+      if (consume(in, buf, len, len) < 0)
+        return -1;
+      writeAll(buf, len);
+      return 0;
+    }
+
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/*
+ * Purpose:   Pass the lines in a peeked block from one pipe to another
+ *            without copying them, consuming exactly what is used.
+ * Arguments: in  - The input.
+ *            buf - The peeked block.
+ *            len - The length of the block.
+ * Returns:   The number of bytes consumed, or -1 on error.
+ */
+static ssize_t
+spliceBlock(input *in, char *buf, size_t len)
+{
+  char *p = buf, *end = buf + len, *eol;
+  size_t n;
+
+  while ((count == 0 || linesRead < count) && p < end) {
+    if ((eol = scanEOL(p, end - p)) == NULL) {
+      partial = 1;
+      if (spliceOut(in, p, end - p) < 0)
+        return -1;
+      return len;
+    }
+
+    /*
+     * If the terminator is what would be written after the line
+     * anyway, it goes along with the line.
+     */
+    n = eol - p;
+    if (*eol == outTerm) {
+      if (spliceOut(in, p, n + 1) < 0)
+        return -1;
+    } else {
+      if (spliceOut(in, p, n) < 0 || consume(in, eol, 1, 1) < 0)
+        return -1;
+      putOut(&outTerm, 1);
+    }
+
+    linesRead++;
+    partial = 0;
+    p = eol + 1;
+  }
+
+  return p - buf;
+}
+#endif
+
+/*
+ * Purpose:   Read lines in from an input.
+ * Arguments: in - The input to read from.
+ * Returns:   Nothing.
+ */
+static void
+doline(input *in)
+{
+  ssize_t n;
+  size_t used, keep, clen = 0;
+  size_t tlen = (dlen > 1) ? dlen : 1;
+  char *blk, *p, *end, *eol = NULL;
+  char carry[DELIM_MAX];
+
+  /* Someone else sharing the file may have moved the offset. */
+  if (in->kind == IN_MMAP)
+    in->off = SYS(lseek(in->fd, 0, SEEK_CUR));
+
+  /* Read in the lines. */
   for (;;) {
-    if (read(fd, &ch, (size_t)1) <= 0) {
-      if (errno != EINTR)
-        status = 1;
+    blk = inbuf;
+    if ((n = waitFill(in, &blk, sizeof(inbuf))) == FILL_TIMEOUT) {
+      status = EXIT_TIMEOUT;
       break;
     }
 
-    /* Handle EOF */
-    if (ch == EOF) {
-      status = 1;
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 || count != 0 || (linesRead == 0 && !partial && clen == 0))
+        status = EXIT_EOF;
       break;
     }
 
+    if (idle >= 0)
+      lastByte = nowMs();
+    noteData();
+
+    p = blk;
+    end = blk + n;
+
+    /*
+     * A multi-byte delimiter can straddle two blocks, so the tail of
+     * a block that might begin one is held back and looked at with
+     * the start of the next.  Everything read is still consumed: the
+     * held back bytes belong to this line or to its delimiter.
+     */
+    if (clen > 0)
+      p += joinCarry(in, carry, &clen, p, n);
+
+#ifdef __linux__
+    /*
+     * Lines going from a pipe to a pipe unaltered can be moved by the
+     * kernel without being copied through here.
+     */
+    if (in->kind == IN_PIPE && outPipe && dlen <= 1 && maxBytes == 0 &&
+        !shellOut && !serving && source == NULL)
+    {
+      if ((n = spliceBlock(in, blk, n)) < 0) {
+        perror("line");
+        status = EXIT_EOF;
+        break;
+      }
+      stats.bytes += n;
+
+      if (count != 0 && linesRead == count)
+        break;
+      continue;
+    }
+#endif
+
     /* Terminates upon newline. */
-    if (ch == '\r' || ch == '\n')
+    while (!tooLong && (count == 0 || linesRead < count) &&
+           p < end && (eol = scanEOL(p, end - p)) != NULL)
+    {
+      p += linePiece(p, eol - p);
+      if (tooLong)
+        break;
+      lineEnd(in);
+      p = eol + tlen;
+    }
+
+    if (!tooLong && (count == 0 || linesRead < count)) {
+      keep = 0;
+      if (dlen > 1) {
+        keep = (size_t)(end - p) < dlen - 1 ? (size_t)(end - p) : dlen - 1;
+        memcpy(carry + clen, end - keep, keep);
+        clen += keep;
+      }
+
+      p += linePiece(p, end - p - keep);
+      if (!tooLong)
+        p = end;
+    }
+
+    used = p - blk;
+    if (consume(in, blk, used, n) < 0) {
+      perror("line");
+      status = EXIT_EOF;
+      break;
+    }
+    stats.bytes += used;
+
+    if (tooLong || (count != 0 && linesRead == count))
       break;
+  }
+
+  /* Anything held back was part of the last line after all. */
+  if (!tooLong)
+    linePiece(carry, clen);
+
+  finish(in);
+}
+
+#ifdef __linux__
+/*
+ * Purpose:   Wait for a complete line on any of several inputs,
+ *            without consuming anything from them.
+ * Arguments: ins - The inputs.
+ *            nin - The number of inputs.
+ * Returns:   The index of the input to read, -1 if every input is at
+ *            EOF, or -2 if a timeout expired.
+ */
+static int
+selectInput(input *ins, int nin)
+{
+  struct epoll_event ev, evs[INPUTS_MAX];
+  char *blk;
+  ssize_t got;
+  int ep, i, k, n, live = 0;
 
-    putchar(ch);
-    fflush(stdout);
+  /* Regular files never block, so look at them first. */
+  for (i = 0; i < nin; i++) {
+    if (ins[i].kind != IN_SEEK && ins[i].kind != IN_MMAP)
+      continue;
+
+    blk = inbuf;
+    if ((got = fillBlock(&ins[i], &blk, sizeof(inbuf))) != 0) {
+      if (got > 0)
+        consume(&ins[i], blk, 0, got);
+      return i;
+    }
+  }
+
+  if ((ep = epoll_create1(0)) < 0) {
+    perror("epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+
+  /*
+   * Inputs that can be peeked at are edge-triggered so that a partial
+   * line does not wake us up again until more arrives.  A terminal
+   * only becomes readable once it has a whole line, and a message is
+   * taken whole.
+   */
+  for (i = 0; i < nin; i++) {
+    if (ins[i].kind == IN_SEEK || ins[i].kind == IN_MMAP)
+      continue;
+
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    if (ins[i].kind != IN_BYTE && ins[i].kind != IN_MSG)
+      ev.events |= EPOLLET;
+    ev.data.u32 = i;
+
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, ins[i].fd, &ev) < 0) {
+      perror(ins[i].name);
+      exit(EXIT_FAILURE);
+    }
+    live++;
+  }
+
+  while (live > 0) {
+    if ((n = SYS(epoll_wait(ep, evs, INPUTS_MAX, waitMs()))) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      exit(EXIT_FAILURE);
+    }
+
+    if (n == 0) {
+      close(ep);
+      return -2;
+    }
+
+    for (k = 0; k < n; k++) {
+      i = evs[k].data.u32;
+
+      if (ins[i].kind == IN_BYTE || ins[i].kind == IN_MSG)
+        goto found;
+
+      /* Let `doline' report any error. */
+      blk = inbuf;
+      if ((got = fillBlock(&ins[i], &blk, sizeof(inbuf))) < 0)
+        goto found;
+
+      if (got == 0) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, ins[i].fd, NULL);
+        live--;
+        continue;
+      }
+
+      consume(&ins[i], blk, 0, got);
+
+      /*
+       * Take this input if it has a whole line, if the line will not
+       * fit in a peek, or if nothing more will arrive to end it.
+       */
+      if (scanEOL(blk, got) != NULL ||
+          (size_t)got == sizeof(inbuf) ||
+          (evs[k].events & (EPOLLHUP | EPOLLRDHUP)) != 0)
+        goto found;
+    }
+  }
+
+  close(ep);
+  return -1;
+
+found:
+  close(ep);
+  return i;
+}
+#endif
+
+/*
+ * Purpose:   Open an input named on the command line.
+ * Arguments: in   - The input.
+ *            path - The path to open.
+ * Returns:   Nothing.
+ */
+static void
+openPath(input *in, const char *path)
+{
+  int fd;
+
+  /* Do not wait for a writer when opening a FIFO. */
+  if ((fd = open(path, O_RDONLY | O_NONBLOCK)) < 0) {
+    perror(path);
+    exit(EXIT_EOF);
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  openInput(in, fd, path);
+}
+
+/*
+ * Purpose:   Find a server input by name, opening it on first use.
+ *            Inputs stay open so each request continues where the
+ *            last one left off.
+ * Arguments: name - A file descriptor number or a path.
+ * Returns:   The input, or NULL if it could not be opened.
+ */
+static input *
+lookupSource(const char *name)
+{
+  static input srcs[INPUTS_MAX];
+  static char names[INPUTS_MAX][REQ_MAX];
+  static int nsrc;
+  int fd, i;
+
+  for (i = 0; i < nsrc; i++)
+    if (strcmp(names[i], name) == 0)
+      return &srcs[i];
+
+  if (nsrc == INPUTS_MAX)
+    return NULL;
+
+  if ((fd = parseFd(name)) < 0) {
+    if ((fd = open(name, O_RDONLY | O_NONBLOCK)) < 0)
+      return NULL;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  } else if (fcntl(fd, F_GETFL) < 0) {
+    return NULL;
+  }
+
+  strcpy(names[nsrc], name);
+  openInput(&srcs[nsrc], fd, names[nsrc]);
+  return &srcs[nsrc++];
+}
+
+/*
+ * Purpose:   Answer requests until the client goes away.
+ *
+ *            Each request is a line holding an input (a file
+ *            descriptor number or a path), optionally a timeout in
+ *            seconds (or `-') and optionally a delimiter.  The
+ *            answer is a line holding the exit status `line' would
+ *            have returned, a space and the line read, escaped so
+ *            that a record holding newlines cannot split it.
+ * Arguments: req - Where requests come from.
+ *            out - Where answers go.
+ * Returns:   Nothing.
+ */
+static void
+serve(FILE *req, int out)
+{
+  char buf[REQ_MAX], num[16];
+  char *name, *tmo, *dl;
+  char defdelim[DELIM_MAX];
+  size_t defdlen = dlen;
+  double deftimeout = timeout;
+  input *in;
+  int len;
+
+  memcpy(defdelim, delim, sizeof(delim));
+
+  outfd = out;
+  outError = 0;
+
+  while (!outError && fgets(buf, sizeof(buf), req) != NULL) {
+    if ((name = strtok(buf, " \t\r\n")) == NULL)
+      continue;
+    tmo = strtok(NULL, " \t\r\n");
+    dl = strtok(NULL, " \t\r\n");
+
+    /* Start afresh. */
+    status = 0;
+    linesRead = 0;
+    partial = 0;
+    thisLen = 0;
+    tooLong = 0;
+    timeout = deftimeout;
+    if (tmo != NULL && strcmp(tmo, "-") != 0 &&
+        (timeout = parseSecs(tmo)) < 0)
+    {
+      /* A bad timeout is a bad request, not a missing one. */
+      putOut("2 \n", 3);
+      flushOut();
+      continue;
+    }
+
+    memcpy(delim, defdelim, sizeof(delim));
+    dlen = defdlen;
+    if (dl != NULL)
+      dlen = unescape(delim, sizeof(delim), dl);
+
+    lastByte = nowMs();
+    deadline = -1;
+    if (timeout >= 0)
+      deadline = lastByte + (long long)(timeout * 1000);
+
+    if ((in = lookupSource(name)) == NULL)
+      status = EXIT_EOF;
+    else
+      doline(in);
+
+    len = snprintf(num, sizeof(num), "%d ", status);
+    putOut(num, len);
+    putEscaped(linebuf, linelen);
+    putOut("\n", 1);
+    flushOut();
+    arenaReset();
+  }
+}
+
+/*
+ * Purpose:   Serve clients connecting to a Unix-domain socket, one
+ *            at a time.
+ * Arguments: path - The path of the socket.
+ * Returns:   Nothing.
+ */
+static void
+serveSocket(const char *path)
+{
+  struct sockaddr_un addr;
+  FILE *req;
+  int sock, conn;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "line: socket path too long\n");
+    exit(EXIT_USAGE);
+  }
+  strcpy(addr.sun_path, path);
+
+  if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    perror("socket");
+    exit(EXIT_FAILURE);
   }
 
-  /* If we get this far, we have what we need and can kill the alarm. */
-  if (timeout > 0)
-    alarm(0);
+  unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sock, 8) < 0)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  for (;;) {
+    if ((conn = accept(sock, NULL, NULL)) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("accept");
+      exit(EXIT_FAILURE);
+    }
+
+    if ((req = fdopen(conn, "r")) == NULL) {
+      close(conn);
+      continue;
+    }
+
+    serve(req, conn);
+    fclose(req);
+  }
+}
 
-  /* Write out a newline. */
-  putchar('\n');
+/*
+ * Purpose:   Display usage and exit.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+usage(void)
+{
+  fprintf(stderr,
+          "usage: line [-sz] [-t timeout] [-i idle] [-n count] "
+          "[-d delim] [-F delims]\n"
+          "            [-p prefix] [-e engine] "
+          "[-c maxbytes | -C maxbytes]\n"
+          "            [-u fd ...] [file ...]\n"
+          "       line -S | -L socket [-t timeout] [-i idle] "
+          "[-e engine]\n"
+          "            [-c maxbytes | -C maxbytes]\n");
+  exit(EXIT_USAGE);
 }
 
 /*
@@ -122,18 +1935,165 @@ doline(int fd)
 int
 main(int argc, char **argv)
 {
-  /* If we have 3 arguments, then we have a timeout. */
-  if (argc == 3) {
-    if (strncmp(argv[1], "-t", 2) == 0) {
-      timeout = atoi(argv[2]);
+  input ins[INPUTS_MAX];
+  int nin = 0, i, c, fd;
+  char *end, *sockpath = NULL;
+
+  while ((c = getopt(argc, argv, "t:i:n:sF:p:u:SL:d:ze:c:C:")) != -1) {
+    switch (c) {
+    case 't':
+      if ((timeout = parseSecs(optarg)) < 0)
+        usage();
+      break;
+    case 'i':
+      if ((idle = parseSecs(optarg)) < 0)
+        usage();
+      break;
+    case 'n':
+      errno = 0;
+      count = strtol(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || errno != 0 || count < 0)
+        usage();
+      break;
+    case 's':
+      shellOut = 1;
+      break;
+    case 'F':
+      delims = optarg;
+      break;
+    case 'p':
+      prefix = optarg;
+      break;
+    case 'u':
+      if ((fd = parseFd(optarg)) < 0 || nin == INPUTS_MAX)
+        usage();
+      if (fcntl(fd, F_GETFL) < 0) {
+        perror(optarg);
+        exit(EXIT_EOF);
+      }
+      openInput(&ins[nin++], fd, optarg);
+      break;
+    case 'd':
+      if ((dlen = unescape(delim, sizeof(delim), optarg)) == 0)
+        usage();
+      break;
+    case 'z':
+      delim[0] = '\0';
+      dlen = 1;
+      outTerm = '\0';
+      break;
+    case 'c':
+    case 'C':
+      if ((maxBytes = strtoul(optarg, &end, 10)) == 0 || *end != '\0')
+        usage();
+      failLong = (c == 'C');
+      break;
+    case 'e':
+      if (strcmp(optarg, "uring") == 0)
+        useUring = 1;
+      else if (strcmp(optarg, "poll") == 0)
+        useUring = 0;
+      else
+        usage();
+      break;
+    case 'S':
+      serving = 1;
+      break;
+    case 'L':
+      serving = 1;
+      sockpath = optarg;
+      break;
+    default:
+      usage();
     }
   }
 
+  if (shellOut)
+    initDelims();
+
+  /* Lines are kept only for -s and for the server. */
+  if (shellOut || serving)
+    arenaGrow(ARENA_MIN);
+
+#ifdef HAVE_URING
+  /* Fall back to poll(2) where io_uring is not available. */
+  if (useUring && uringInit() < 0)
+    useUring = 0;
+#else
+  useUring = 0;
+#endif
+
   /* To be nice, set the locale. */
   setlocale(LC_ALL, "");
 
+  /* Serve requests for lines rather than reading one ourselves. */
+  if (serving) {
+    shellOut = 0;
+    count = 1;
+    signal(SIGPIPE, SIG_IGN);
+
+    if (sockpath != NULL)
+      serveSocket(sockpath);
+    else
+      serve(stdin, STDOUT_FILENO);
+
+    return EXIT_SUCCESS;
+  }
+
+  for (i = optind; i < argc; i++) {
+    if (nin == INPUTS_MAX)
+      usage();
+    openPath(&ins[nin++], argv[i]);
+  }
+
+  if (nin == 0)
+    openInput(&ins[nin++], STDIN_FILENO, "-");
+
+  /* Flush stdout */
+  fflush(stdout);
+
+  if (getenv("LINE_STATS") != NULL) {
+    stats.on = 1;
+    stats.start = nowUs();
+  }
+
+  {
+    struct stat st;
+
+    outPipe = (fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode));
+  }
+
+  /* Start the clocks. */
+  lastByte = nowMs();
+  if (timeout >= 0)
+    deadline = lastByte + (long long)(timeout * 1000);
+
   /* Read in the line. */
-  doline(STDIN_FILENO);
+  if (nin == 1) {
+    doline(&ins[0]);
+  } else {
+#ifdef __linux__
+    /* Read from whichever input has a line first. */
+    if ((i = selectInput(ins, nin)) == -2) {
+      status = EXIT_TIMEOUT;
+      finish(&ins[0]);
+    } else if (i == -1) {
+      doline(&ins[0]);
+    } else {
+      source = ins[i].name;
+      doline(&ins[i]);
+    }
+#else
+    fprintf(stderr, "line: only one input is supported here\n");
+    exit(EXIT_USAGE);
+#endif
+  }
+
+  for (i = 0; i < nin; i++)
+    closeInput(&ins[i]);
+
+  if (stats.on)
+    reportStats();
 
   /* Return the status. */
   return status;
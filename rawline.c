@@ -34,31 +34,278 @@
  */
 /* }}} */
 
+/* Needed for memmem(3). */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <math.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <termios.h>
+#include <sys/ioctl.h>
 #include <signal.h>
 #include <locale.h>
+#include <poll.h>
+#include <time.h>
 
 #define TTY_RESET        0
 #define TTY_RAW          1
 
+#define BLKSIZE          4096      /* Largest read during a paste. */
+
+/*
+ * Bracketed paste.  Once enabled, the terminal wraps anything pasted
+ * in PASTE_START and PASTE_END, which lets a paste be read in bulk.
+ */
+#define PASTE_ON         "\033[?2004h"
+#define PASTE_OFF        "\033[?2004l"
+#define PASTE_START      "\033[200~"
+#define PASTE_END        "\033[201~"
+#define PASTE_LEN        6
+
+/* How long a lone ESC waits for the rest of a sequence, in ms. */
+#define ESC_DELAY        50
+
+/* Key decoder states. */
+#define DEC_GROUND       0         /* Between keys. */
+#define DEC_ESC          1         /* Seen ESC. */
+#define DEC_CSI          2         /* In ESC [ ... */
+#define DEC_SS3          3         /* Seen ESC O. */
+#define DEC_UTF8         4         /* In a multi-byte character. */
+
+#define KEY_MAX          32        /* Longest key sequence kept. */
+
+/* Count a system call made while reading, for the statistics. */
+#define SYS(call)        (stats.calls++, (call))
+
+/* Exit statuses. */
+#define EXIT_EOF         1         /* End of file or read error. */
+#define EXIT_USAGE       2         /* Bad arguments. */
+#define EXIT_LONG        3         /* The line was too long (-C). */
+#define EXIT_TIMEOUT     124       /* A timeout expired (as timeout(1)). */
+
 static int status;                 /* Exit status. */
-static int timeout = -1;           /* Timeout value. */
+static double timeout = -1;        /* Overall timeout (-t), seconds. */
+static double idle = -1;           /* Inter-key timeout (-i), seconds. */
+static long long deadline = -1;    /* When -t expires, in ms. */
+static long long lastKey;          /* When a key was last read, in ms. */
+static int ttyFd = -1;             /* The terminal in raw mode. */
 static struct termios termAttribs, termAttribsSaved;
 static int ttyState = TTY_RESET;
+static int ttyOut = -1;            /* The terminal, for writing. */
+
+static int events;                 /* Emit key events (-k). */
+static size_t maxBytes;            /* Longest line kept, 0 for any. */
+static int failLong;               /* Fail rather than truncate (-C). */
+static size_t lineLen;             /* Length of the line so far. */
+static int tooLong;                /* The line went over `maxBytes'. */
 
 /*
- * Purpose:   Signal handler for timeout and interrupt.
+ * Statistics, reported on exit when RAWLINE_STATS is set in the
+ * environment.  Times are in microseconds.
+ */
+static struct {
+  int on;                          /* Keeping the times. */
+  long long start;                 /* When we started. */
+  long long first;                 /* When data first arrived. */
+  long long last;                  /* When data last arrived. */
+  long long maxGap;                /* Longest wait between data. */
+  unsigned long long bytes;        /* Bytes read. */
+  unsigned long calls;             /* System calls made reading. */
+} stats;
+
+/* Incremental key decoder. */
+static struct {
+  int state;                       /* One of the DEC_* states. */
+  int need;                        /* UTF-8 continuation bytes to come. */
+  size_t len;                      /* Bytes in `seq'. */
+  char seq[KEY_MAX];               /* The key so far. */
+} dec;
+
+/* Names of keys sent as ESC [ n ~ */
+static const struct {
+  int num;
+  const char *name;
+} tildeKeys[] = {
+  { 1, "home" },   { 2, "insert" }, { 3, "delete" }, { 4, "end" },
+  { 5, "pgup" },   { 6, "pgdn" },   { 7, "home" },   { 8, "end" },
+  { 11, "f1" },    { 12, "f2" },    { 13, "f3" },    { 14, "f4" },
+  { 15, "f5" },    { 17, "f6" },    { 18, "f7" },    { 19, "f8" },
+  { 20, "f9" },    { 21, "f10" },   { 23, "f11" },   { 24, "f12" },
+  { 200, "paste-start" }, { 201, "paste-end" },
+  { 0, NULL }
+};
+
+static char outbuf[BLKSIZE];       /* Pending output. */
+static size_t outlen;              /* Bytes pending in `outbuf'. */
+
+/*
+ * Purpose:   Signal handler for interrupt and termination.  Puts the
+ *            terminal back as it was, then dies of the signal.
  * Arguments: signum - The signal number.
  * Returns:   Nothing.
  */
 static void
 handler(int signum)
 {
+  if (ttyState == TTY_RAW) {
+    if (ttyOut >= 0)
+      write(ttyOut, PASTE_OFF, sizeof(PASTE_OFF) - 1);
+    tcsetattr(ttyFd, TCSAFLUSH, &termAttribsSaved);
+  }
+
+  signal(signum, SIG_DFL);
+  raise(signum);
+}
+
+/*
+ * Purpose:   Read the monotonic clock.
+ * Arguments: None.
+ * Returns:   The time in milliseconds.
+ */
+static long long
+nowMs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Purpose:   Read the monotonic clock.
+ * Arguments: None.
+ * Returns:   The time in microseconds.
+ */
+static long long
+nowUs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Purpose:   Note that data have arrived, for the statistics.
+ * Arguments: now - The time in microseconds.
+ *            len - The number of bytes.
+ * Returns:   Nothing.
+ */
+static void
+noteData(long long now, size_t len)
+{
+  stats.bytes += len;
+
+  if (stats.first == 0)
+    stats.first = now;
+  else if (now - stats.last > stats.maxGap)
+    stats.maxGap = now - stats.last;
+  stats.last = now;
+}
+
+/*
+ * Purpose:   Write the statistics out as a single line, to stderr or
+ *            appended to the file named by RAWLINE_STATS.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+reportStats(void)
+{
+  const char *path = getenv("RAWLINE_STATS");
+  char rec[256];
+  long long end = nowUs();
+  int fd = STDERR_FILENO, n;
+
+  n = snprintf(rec, sizeof(rec),
+               "rawline: ttfb_us=%lld read_us=%lld bytes=%llu syscalls=%lu "
+               "max_gap_us=%lld timeout=%d status=%d\n",
+               stats.first ? stats.first - stats.start : -1LL,
+               end - stats.start,
+               stats.bytes,
+               stats.calls,
+               stats.maxGap,
+               status == EXIT_TIMEOUT,
+               status);
+
+  if (*path != '\0' && strcmp(path, "1") != 0 && strcmp(path, "-") != 0 &&
+      (fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666)) < 0)
+    return;
+
+  write(fd, rec, n);
+
+  if (fd != STDERR_FILENO)
+    close(fd);
+}
+
+/*
+ * Purpose:   Parse a timeout given in (possibly fractional) seconds.
+ *            Timeouts are kept to what fits in an int of milliseconds.
+ * Arguments: str - The string to parse.
+ * Returns:   The timeout in seconds, or -1 if it is not valid.
+ */
+static double
+parseSecs(const char *str)
+{
+  char *end;
+  double secs;
+
+  secs = strtod(str, &end);
+  if (end == str || *end != '\0' || !isfinite(secs) || secs < 0)
+    return -1;
+
+  if (secs > INT_MAX / 1000.0)
+    secs = INT_MAX / 1000.0;
+
+  return secs;
+}
+
+/*
+ * Purpose:   Wait for a key within the timeouts.
+ * Arguments: fd - The file descriptor to wait on.
+ * Returns:   1 if input is ready, 0 if a timeout expired.
+ */
+static int
+waitKey(int fd)
+{
+  struct pollfd pfd;
+  long long now, wait, left;
+  int r;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  for (;;) {
+    now = nowMs();
+    wait = -1;
+
+    /* Wait for whichever timeout expires first. */
+    if (deadline >= 0)
+      wait = (deadline > now) ? deadline - now : 0;
+
+    if (idle >= 0) {
+      left = lastKey + (long long)(idle * 1000) - now;
+      if (left < 0)
+        left = 0;
+      if (wait < 0 || left < wait)
+        wait = left;
+    }
+
+    if ((r = SYS(poll(&pfd, 1, (int)wait))) > 0)
+      return 1;
+
+    if (r == 0)
+      return 0;
+
+    if (errno != EINTR) {
+      /* Let the read report the problem. */
+      return 1;
+    }
+  }
 }
 
 /*
@@ -78,6 +325,7 @@ setRaw(int fd)
   }
 
   termAttribsSaved = termAttribs;
+  ttyFd = fd;
 
   termAttribs.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
   termAttribs.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
@@ -95,6 +343,11 @@ setRaw(int fd)
 
   ttyState = TTY_RAW;
 
+  /* Ask the terminal to bracket pastes. */
+  if (ttyname(fd) != NULL &&
+      (ttyOut = open(ttyname(fd), O_WRONLY | O_NOCTTY)) >= 0)
+    write(ttyOut, PASTE_ON, sizeof(PASTE_ON) - 1);
+
   return 0;
 }
 
@@ -112,7 +365,14 @@ setCooked(int fd)
   if (ttyState != TTY_RAW)
     return 0;
 
-  if ((i = (tcsetattr(fd, TCSAFLUSH, &termAttribsSaved))) < 0) {
+  if (ttyOut >= 0) {
+    write(ttyOut, PASTE_OFF, sizeof(PASTE_OFF) - 1);
+    close(ttyOut);
+    ttyOut = -1;
+  }
+
+  /* Keep anything typed ahead for whoever reads next. */
+  if ((i = (tcsetattr(fd, TCSADRAIN, &termAttribsSaved))) < 0) {
     perror("tcsetattr");
     return -1;
   }
@@ -121,6 +381,107 @@ setCooked(int fd)
   return 0;
 }
 
+/*
+ * Purpose:   Write out any pending output in one go.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+flushOut(void)
+{
+  char *p = outbuf;
+  ssize_t n;
+
+  while (outlen > 0) {
+    if ((n = SYS(write(STDOUT_FILENO, p, outlen))) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("write");
+      break;
+    }
+    p += n;
+    outlen -= n;
+  }
+
+  outlen = 0;
+}
+
+/*
+ * Purpose:   Account for bytes added to the line, keeping it within
+ *            `maxBytes'.
+ * Arguments: len - The number of bytes.
+ * Returns:   How many of them to keep.
+ */
+static size_t
+lineRoom(size_t len)
+{
+  size_t room;
+
+  if (maxBytes == 0 || lineLen + len <= maxBytes) {
+    lineLen += len;
+    return len;
+  }
+
+  room = (lineLen < maxBytes) ? maxBytes - lineLen : 0;
+  lineLen = maxBytes;
+
+  if (failLong) {
+    tooLong = 1;
+    status = EXIT_LONG;
+  }
+
+  return room;
+}
+
+/*
+ * Purpose:   Queue pasted text for output.  Pasted line breaks arrive
+ *            as carriage returns and are written as newlines.
+ * Arguments: buf - The text.
+ *            len - The length of the text.
+ * Returns:   Nothing.
+ */
+static void
+putPaste(const char *buf, size_t len)
+{
+  size_t n;
+
+  len = lineRoom(len);
+
+  while (len > 0) {
+    if (outlen == sizeof(outbuf))
+      flushOut();
+
+    n = sizeof(outbuf) - outlen;
+    if (n > len)
+      n = len;
+
+    memcpy(outbuf + outlen, buf, n);
+    for (; n > 0; n--, len--, buf++, outlen++)
+      if (outbuf[outlen] == '\r')
+        outbuf[outlen] = '\n';
+  }
+}
+
+/*
+ * Purpose:   Work out how many bytes at the end of a buffer could be
+ *            the start of a marker that has not fully arrived.
+ * Arguments: buf    - The buffer.
+ *            len    - The length of the buffer.
+ *            marker - The marker.
+ * Returns:   The number of bytes to hold back.
+ */
+static size_t
+markerTail(const char *buf, size_t len, const char *marker)
+{
+  size_t n;
+
+  for (n = (len < PASTE_LEN - 1) ? len : PASTE_LEN - 1; n > 0; n--)
+    if (memcmp(buf + len - n, marker, n) == 0)
+      return n;
+
+  return 0;
+}
+
 /*
  * Purpose:   Read a line in from a given file descriptor.
  * Arguments: fd - The file descriptor to read from.
@@ -129,11 +490,11 @@ setCooked(int fd)
 static void
 doline(int fd)
 {
-  char ch;
-  struct sigaction act;
-
-  /* Clear the memory for the signal action. */
-  memset(&act, 0, sizeof(act));
+  char buf[BLKSIZE];
+  size_t have = 0, i, keep;
+  ssize_t n;
+  int pasting = 0, done = 0;
+  char *m;
 
   /* Flush stdout */
   fflush(stdout);
@@ -141,50 +502,390 @@ doline(int fd)
   /* Set the terminal to raw mode. */
   setRaw(fd);
 
+  /* Start the clocks. */
+  lastKey = nowMs();
+  if (timeout >= 0)
+    deadline = lastKey + (long long)(timeout * 1000);
+
   /*
-   * If a timeout is given and is above zero, then we should
-   * $initialize the signal handler and start the alarm countdown.
+   * Read in the line.  Typed input is read a byte at a time so that
+   * nothing typed after the end of the line is taken from the next
+   * reader, but a paste is drained as fast as it arrives.  Once what
+   * may be the start of the end marker is held, reading goes back to
+   * a byte at a time so as not to run past the marker.
    */
-  if (timeout > 0) {
-    act.sa_handler = handler;
-    if (sigaction(SIGALRM, &act, NULL) == -1) {
-      perror("sigaction");
-      exit(EXIT_FAILURE);
-    }
-    alarm(timeout);
-  }
-
-  /* Read in the line. */
-  for (;;) {
-    if (read(fd, &ch, (size_t)1) <= 0) {
-      if (errno != EINTR)
-        status = 1;
+  while (!done) {
+    if ((timeout >= 0 || idle >= 0) && !waitKey(fd)) {
+      status = EXIT_TIMEOUT;
       break;
     }
 
-    /* Handle EOF */
-    if (ch == EOF) {
-      status = 1;
+    n = SYS(read(fd, buf + have, pasting && have == 0 ? sizeof(buf) : 1));
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      status = EXIT_EOF;
       break;
     }
+    have += n;
+
+    if (stats.on)
+      noteData(nowUs(), n);
+
+    if (idle >= 0)
+      lastKey = nowMs();
+
+    for (i = 0; i < have && !done; ) {
+      if (pasting) {
+        if ((m = memmem(buf + i, have - i, PASTE_END, PASTE_LEN)) != NULL) {
+          putPaste(buf + i, m - (buf + i));
+          i = m - buf + PASTE_LEN;
+          pasting = 0;
+          done = tooLong;
+          continue;
+        }
+
+        /* Hold back what might be the start of the end marker. */
+        keep = markerTail(buf + i, have - i, PASTE_END);
+        putPaste(buf + i, have - i - keep);
+        i = have - keep;
+        done = tooLong;
+        break;
+      }
+
+      if (buf[i] == PASTE_START[0]) {
+        if (have - i < PASTE_LEN &&
+            memcmp(buf + i, PASTE_START, have - i) == 0)
+          break;
+
+        if (have - i >= PASTE_LEN &&
+            memcmp(buf + i, PASTE_START, PASTE_LEN) == 0) {
+          pasting = 1;
+          i += PASTE_LEN;
+          continue;
+        }
+      }
+
+      /* Terminates upon newline. */
+      if (buf[i] == '\r' || buf[i] == '\n') {
+        done = 1;
+        break;
+      }
+
+      if (lineRoom(1) == 0) {
+        /* Typed beyond the limit: drop it, or give up with -C. */
+        done = tooLong;
+        i++;
+        continue;
+      }
+
+      outbuf[outlen++] = buf[i++];
+      if (outlen == sizeof(outbuf))
+        flushOut();
+    }
 
-    /* Terminates upon newline. */
-    if (ch == '\r' || ch == '\n')
-      break;
+    /* Keep anything not yet dealt with for the next read. */
+    memmove(buf, buf + i, have - i);
+    have -= i;
 
-    putchar(ch);
-    fflush(stdout);
+    /* Echo everything from this read at once. */
+    flushOut();
   }
 
-  /* If we get this far, we have what we need and can kill the alarm. */
-  if (timeout > 0)
-    alarm(0);
+#ifdef TIOCSTI
+  /*
+   * What was typed after a paste may have come in with its last read;
+   * give back whatever followed the end of the line, where allowed.
+   */
+  if (done && have > 0 && (buf[0] == '\r' || buf[0] == '\n')) {
+    for (i = 1; i < have; i++)
+      if (ioctl(fd, TIOCSTI, buf + i) < 0)
+        break;
+  }
+#endif
 
   /* Restore the terminal. */
   setCooked(fd);
 
   /* Write out a newline. */
-  putchar('\n');
+  outbuf[outlen++] = '\n';
+  flushOut();
+}
+
+/*
+ * Purpose:   Queue output, writing it out when the buffer fills.
+ * Arguments: buf - The data.
+ *            len - The length of the data.
+ * Returns:   Nothing.
+ */
+static void
+putOut(const char *buf, size_t len)
+{
+  size_t n;
+
+  while (len > 0) {
+    if (outlen == sizeof(outbuf))
+      flushOut();
+
+    n = sizeof(outbuf) - outlen;
+    if (n > len)
+      n = len;
+
+    memcpy(outbuf + outlen, buf, n);
+    outlen += n;
+    buf += n;
+    len -= n;
+  }
+}
+
+/*
+ * Purpose:   Name a decoded key.
+ * Arguments: seq - The bytes of the key.
+ *            len - The number of bytes.
+ * Returns:   The name of the key.
+ */
+static const char *
+keyName(const char *seq, size_t len)
+{
+  int i, num;
+  char fin;
+
+  if (len == 1) {
+    if (seq[0] == '\r' || seq[0] == '\n')
+      return "enter";
+    if (seq[0] == '\t')
+      return "tab";
+    if (seq[0] == 0x1b)
+      return "esc";
+    if (seq[0] == 0x7f || seq[0] == 0x08)
+      return "backspace";
+    if ((unsigned char)seq[0] < 0x20)
+      return "ctrl";
+    return "char";
+  }
+
+  if (seq[0] != 0x1b)
+    return "char";                 /* A multi-byte character. */
+
+  if (len == 2)
+    return "alt";
+
+  fin = seq[len - 1];
+
+  /* ESC O x */
+  if (seq[1] == 'O') {
+    switch (fin) {
+    case 'A': return "up";
+    case 'B': return "down";
+    case 'C': return "right";
+    case 'D': return "left";
+    case 'H': return "home";
+    case 'F': return "end";
+    case 'P': return "f1";
+    case 'Q': return "f2";
+    case 'R': return "f3";
+    case 'S': return "f4";
+    }
+    return "seq";
+  }
+
+  /* ESC [ params final; modifiers after a `;' are ignored. */
+  switch (fin) {
+  case 'A': return "up";
+  case 'B': return "down";
+  case 'C': return "right";
+  case 'D': return "left";
+  case 'H': return "home";
+  case 'F': return "end";
+  case 'Z': return "backtab";
+  case '~':
+    num = atoi(seq + 2);
+    for (i = 0; tildeKeys[i].name != NULL; i++)
+      if (tildeKeys[i].num == num)
+        return tildeKeys[i].name;
+    break;
+  }
+
+  return "seq";
+}
+
+/*
+ * Purpose:   Queue a key event record: the time, the bytes of the key
+ *            in caret notation, and its name.
+ * Arguments: ts  - When the key was read.
+ *            seq - The bytes of the key.
+ *            len - The number of bytes.
+ * Returns:   Nothing.
+ */
+static void
+putEvent(const struct timespec *ts, const char *seq, size_t len)
+{
+  char rec[KEY_MAX * 4 + 64];
+  unsigned char ch;
+  size_t i;
+  int n;
+
+  n = snprintf(rec, sizeof(rec), "%lld.%06ld ",
+               (long long)ts->tv_sec, ts->tv_nsec / 1000);
+
+  for (i = 0; i < len; i++) {
+    ch = seq[i];
+    if (ch < 0x20) {
+      rec[n++] = '^';
+      rec[n++] = ch + '@';
+    } else if (ch == 0x7f) {
+      rec[n++] = '^';
+      rec[n++] = '?';
+    } else if (ch == ' ' || ch == '\\') {
+      n += sprintf(rec + n, "\\x%02x", ch);
+    } else {
+      rec[n++] = ch;
+    }
+  }
+
+  n += snprintf(rec + n, sizeof(rec) - n, " %s\n", keyName(seq, len));
+  putOut(rec, n);
+}
+
+/*
+ * Purpose:   Feed a byte to the key decoder.
+ * Arguments: ts - When the byte was read.
+ *            ch - The byte.
+ * Returns:   Nothing.
+ */
+static void
+decodeKey(const struct timespec *ts, char ch)
+{
+  unsigned char uc = ch;
+
+  if (dec.len < KEY_MAX)
+    dec.seq[dec.len++] = ch;
+
+  switch (dec.state) {
+  case DEC_GROUND:
+    if (uc == 0x1b) {
+      dec.state = DEC_ESC;
+      return;
+    }
+    if (uc >= 0xc0 && uc < 0xf8) {
+      dec.state = DEC_UTF8;
+      dec.need = (uc >= 0xf0) ? 3 : (uc >= 0xe0) ? 2 : 1;
+      return;
+    }
+    break;
+
+  case DEC_ESC:
+    if (ch == '[') {
+      dec.state = DEC_CSI;
+      return;
+    }
+    if (ch == 'O') {
+      dec.state = DEC_SS3;
+      return;
+    }
+    break;
+
+  case DEC_CSI:
+    /* Parameters and intermediates until a final byte. */
+    if (uc >= 0x20 && uc <= 0x3f)
+      return;
+    break;
+
+  case DEC_SS3:
+    break;
+
+  case DEC_UTF8:
+    if ((uc & 0xc0) == 0x80 && --dec.need > 0)
+      return;
+    break;
+  }
+
+  putEvent(ts, dec.seq, dec.len);
+  dec.state = DEC_GROUND;
+  dec.len = 0;
+}
+
+/*
+ * Purpose:   Stream a record for every key until ^D, EOF or a
+ *            timeout.
+ * Arguments: fd - The file descriptor to read from.
+ * Returns:   Nothing.
+ */
+static void
+doevents(int fd)
+{
+  char buf[BLKSIZE];
+  struct timespec ts;
+  struct pollfd pfd;
+  ssize_t n, i;
+  int done = 0;
+
+  setRaw(fd);
+
+  lastKey = nowMs();
+  if (timeout >= 0)
+    deadline = lastKey + (long long)(timeout * 1000);
+
+  while (!done) {
+    if ((timeout >= 0 || idle >= 0) && !waitKey(fd)) {
+      status = EXIT_TIMEOUT;
+      break;
+    }
+
+    if ((n = SYS(read(fd, buf, sizeof(buf)))) <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      status = EXIT_EOF;
+      break;
+    }
+
+    /* One clock read per wakeup stamps the whole batch. */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    lastKey = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    if (stats.on)
+      noteData((long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000, n);
+
+    for (i = 0; i < n && !done; i++) {
+      if (buf[i] == 0x04 && dec.state == DEC_GROUND)
+        done = 1;
+      else
+        decodeKey(&ts, buf[i]);
+    }
+
+    /*
+     * An ESC on its own is either the Escape key or the start of a
+     * sequence; give the rest of a sequence a moment to turn up.
+     */
+    if (dec.state == DEC_ESC && dec.len == 1) {
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      if (SYS(poll(&pfd, 1, ESC_DELAY)) == 0) {
+        putEvent(&ts, dec.seq, dec.len);
+        dec.state = DEC_GROUND;
+        dec.len = 0;
+      }
+    }
+
+    /* Stream the batch with one write. */
+    flushOut();
+  }
+
+  setCooked(fd);
+  flushOut();
+}
+
+/*
+ * Purpose:   Display usage and exit.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+usage(void)
+{
+  fprintf(stderr,
+          "usage: rawline [-k] [-t timeout] [-i idle] "
+          "[-c maxbytes | -C maxbytes]\n");
+  exit(EXIT_USAGE);
 }
 
 /*
@@ -193,18 +894,60 @@ doline(int fd)
 int
 main(int argc, char **argv)
 {
-  /* If we have 3 arguments, then we have a timeout. */
-  if (argc == 3) {
-    if (strncmp(argv[1], "-t", 2) == 0) {
-      timeout = atoi(argv[2]);
+  int c;
+  char *end;
+  struct sigaction act;
+
+  while ((c = getopt(argc, argv, "t:i:kc:C:")) != -1) {
+    switch (c) {
+    case 't':
+      if ((timeout = parseSecs(optarg)) < 0)
+        usage();
+      break;
+    case 'i':
+      if ((idle = parseSecs(optarg)) < 0)
+        usage();
+      break;
+    case 'k':
+      events = 1;
+      break;
+    case 'c':
+    case 'C':
+      if ((maxBytes = strtoul(optarg, &end, 10)) == 0 || *end != '\0')
+        usage();
+      failLong = (c == 'C');
+      break;
+    default:
+      usage();
     }
   }
 
   /* To be nice, set the locale. */
   setlocale(LC_ALL, "");
 
-  /* Read in the line. */
-  doline(STDIN_FILENO);
+  /*
+   * Make sure the terminal is restored should we be killed while it
+   * is in raw mode.
+   */
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = handler;
+  sigaction(SIGINT, &act, NULL);
+  sigaction(SIGTERM, &act, NULL);
+  sigaction(SIGHUP, &act, NULL);
+
+  if (getenv("RAWLINE_STATS") != NULL) {
+    stats.on = 1;
+    stats.start = nowUs();
+  }
+
+  /* Read in the line, or the keys. */
+  if (events)
+    doevents(STDIN_FILENO);
+  else
+    doline(STDIN_FILENO);
+
+  if (stats.on)
+    reportStats();
 
   /* Return the status. */
   return status;
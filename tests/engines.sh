@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# engines.sh --- run line(1) with each engine and compare the results
+#
+# Usage: sh tests/engines.sh [path-to-line]
+#
+# Every case is run with -e poll and -e uring; each must give the
+# output and exit status expected of it, so both engines are checked
+# against line(1) and not merely against each other.  Where io_uring is
+# not available, line falls back to poll.
+#
+
+LINE=${1:-./line}
+TMP=${TMPDIR:-/tmp}/engines.$$
+mkdir -p "$TMP" || exit 1
+trap 'rm -rf "$TMP"' 0
+
+printf 'first\nsecond\nthird\n' > "$TMP/file"
+
+# Each case reads the engine from $E.
+case_pipe()      { printf 'a\nb\n' | { $LINE -e $E; $LINE -e $E; }; }
+case_pipe_all()  { printf 'a\nb\nc' | $LINE -e $E -n 0; }
+case_pipe_rest() { printf 'a\nb\n' | { $LINE -e $E; cat; }; }
+case_partial()   { (printf 'par'; sleep 1) | $LINE -e $E -t 0.2; }
+case_timeout()   { sleep 1 | $LINE -e $E -t 0.1; }
+case_idle()      { (printf 'x'; sleep 1) | $LINE -e $E -i 0.2; }
+case_late()      { (sleep 0.2; printf 'late\n') | $LINE -e $E -t 2; }
+case_file()      { $LINE -e $E < "$TMP/file"; }
+case_file_rest() { { $LINE -e $E; cat; } < "$TMP/file"; }
+case_file_n()    { $LINE -e $E -n 2 < "$TMP/file"; }
+case_empty()     { $LINE -e $E < /dev/null; }
+
+# check case output status: run a case with each engine, comparing
+# what it writes with output (a printf(1) format) and its exit status.
+fail=0
+check()
+{
+  printf "$2" > "$TMP/$1.want"
+  echo "status $3" >> "$TMP/$1.want"
+
+  for E in poll uring; do
+    case_$1 > "$TMP/$1.$E" 2>&1
+    echo "status $?" >> "$TMP/$1.$E"
+
+    if cmp -s "$TMP/$1.want" "$TMP/$1.$E"; then
+      echo "ok   $1 ($E)"
+    else
+      echo "FAIL $1 ($E)"
+      diff "$TMP/$1.want" "$TMP/$1.$E"
+      fail=1
+    fi
+  done
+}
+
+check pipe      'a\nb\n'                   0
+check pipe_all  'a\nb\nc\n'                0
+check pipe_rest 'a\nb\n'                   0
+check partial   'par\n'                    124
+check timeout   '\n'                       124
+check idle      'x\n'                      124
+check late      'late\n'                   0
+check file      'first\n'                  0
+check file_rest 'first\nsecond\nthird\n'   0
+check file_n    'first\nsecond\n'          0
+check empty     '\n'                       1
+
+exit $fail
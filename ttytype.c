@@ -46,9 +46,21 @@
 #include <signal.h>
 #include <termios.h>
 #include <stdarg.h>
+#include <poll.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <stdint.h>
 
 #include <sys/param.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+# include <sys/epoll.h>
+#endif
 
 /* ================================================================== */
 /* {{{ definitions: */
@@ -69,6 +81,86 @@
 #define TERM_HP       2
 #define TERM_WYSE     3
 
+/*
+ * Longest a probe waits for its reply, in milliseconds, when nothing
+ * is known about the line.  Replies normally end well before this;
+ * see `replyDone'.
+ */
+#define PROBE_TIMEOUT 1000
+
+/*
+ * How long a terminal on a serial line may take to start answering,
+ * in milliseconds.  Time for the characters themselves is added at
+ * the line speed, twice over.
+ */
+#define LINE_LATENCY  300
+
+/*
+ * Slack added to a probe's deadline on a pseudo-terminal, beyond
+ * four round trips measured from the first reply, in milliseconds.
+ */
+#define PTY_SLACK     25
+
+/*
+ * What ends the reply to a probe, passed to `rawread'.  Anything
+ * else is the final byte of the reply.
+ */
+#define REPLY_DA      -1                /* DA/DECID: CSI final byte. */
+#define REPLY_BURST   -2                /* Replies to `identBurst'. */
+#define REPLY_CAPS    -3                /* Replies to `identCaps'. */
+
+/* Kinds of reply found in what a probe burst brings back. */
+#define REPLY_NONE    0                 /* Not (yet) a whole reply. */
+#define REPLY_WYSE    1                 /* Wyse ID, ended by CR. */
+#define REPLY_VT52    2                 /* VT52 DECID: ESC / x. */
+#define REPLY_JUNK    3                 /* Nothing we know. */
+
+/*
+ * Once the first reply to a burst is in, how much longer to wait for
+ * the rest, in milliseconds.  A terminal answers the probes of a
+ * burst back to back.
+ */
+#define PROBE_SETTLE  100
+
+/*
+ * Detection cache (-c).  Results are kept for CACHE_TTL seconds in a
+ * file of at most CACHE_MAX fixed-size records.
+ */
+#define CACHE_MAGIC   0x54545943        /* "TTYC" */
+#define CACHE_TTL     (60 * 60)
+#define CACHE_MAX     64
+
+/*
+ * Compiled terminal database, made from a text database with -B.  It
+ * can be overridden with TTYTYPE_DB in the environment.
+ */
+#ifndef TERMDB
+# define TERMDB       "/usr/local/share/ttytype/ttytype.trie"
+#endif
+#define TERMDB_MAGIC  0x54525954        /* "TYRT" */
+#define TERMDB_VERSION 1
+
+/*
+ * Table of terminals on watched ports, published by -d and read by
+ * -q.  It can be overridden with TTYTYPE_TABLE in the environment.
+ * Where a port's carrier cannot be waited for, it is looked at every
+ * CARRIER_POLL seconds.
+ */
+#ifndef TERMTABLE
+# define TERMTABLE    "/var/run/ttytype.table"
+#endif
+#define TABLE_MAGIC   0x54545954        /* "TYTT" */
+#define CARRIER_POLL  5
+
+/*
+ * What is known about the line to a terminal, for working out how
+ * long to wait for replies (see `linkWait').
+ */
+struct link {
+  long charUs;                          /* One character; 0 if a pty. */
+  long long rtt;                        /* Round trip, or -1. */
+};
+
 /* }}} */
 /* ================================================================== */
 
@@ -88,7 +180,13 @@ static int pflag = FALSE;               /* -p was passed. */
 static int sflag = FALSE;               /* -s was passed. */
 static int vflag = FALSE;               /* -v was passed. */
 static int tflag = FALSE;               /* -t was passed. */
-static int dflag = FALSE;               /* -d was passed. */
+static int dflag = FALSE;               /* -D was passed. */
+static int bflag = FALSE;               /* -b was passed. */
+static int cflag = FALSE;               /* -c was passed. */
+static int fflag = FALSE;               /* -f was passed. */
+static int xflag = FALSE;               /* -x was passed. */
+static int daemonFlag = FALSE;          /* -d was passed. */
+static char *queryPort = NULL;          /* -q port, if given. */
 
 /* Table for pretty-printing escape codes. */
 static char escapes[] = "@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_\0";
@@ -117,6 +215,13 @@ static struct termios termAttribs, termAttribsSaved;
 static int gotTerm = FALSE;
 static int termType = TERM_UNKNOWN;
 
+/* DA replies that end a probe burst early: 2 if ANSI was probed. */
+static int burstWant = 0;
+
+/* The line to our terminal, and any fixed deadline (-w). */
+static struct link ttyLink = { -1, -1 };
+static int waitMs = -1;
+
 /* The lines/columns this terminal currently has. */
 static int defaultLines = 24;           /* Default No. of lines. */
 static int defaultColumns = 80;         /* Default No. of columns. */
@@ -210,6 +315,16 @@ termTypes ANSI[] = {
 /* }}} */
 /* ------------------------------------------------------------------ */
 
+/* Identification requests. */
+static const char WYID[] = { 0x1b, ' ', 0x00 };          /* Wyse ID */
+static const char DECDA[] = { 0x1b, '[', '0', 'c', 0x00 };
+static const char DECID[] = { 0x1b, 'Z', 0x00 };
+static const char HPID[] = { 0x1b, '*', 's', '1', '^', 0x00 };
+
+/* The longest replies expected to them, for working out deadlines. */
+#define BURST_REPLY   48                /* Wyse ID, DA and DECID. */
+#define HPID_REPLY    32
+
 /*
  * NOTE:  Wyse and HP terminal tables ought to exist here, but I do
  * not actually own any terminal hardare from either manufacturer to
@@ -262,6 +377,25 @@ xmalloc(size_t n)
   return p;
 }
 
+/*
+ * Purpose:   A wrapper around realloc(3) that checks for memory
+ *            exhaustion.
+ * Arguments: p - The memory region to resize.
+ *            n - The new size of the memory region.
+ * Returns:  The resized object.
+ */
+static void *
+xrealloc(void *p, size_t n)
+{
+  p = realloc(p, n);
+  if (p == 0) {
+    perrorf("Memory exhausted while allocating %u bytes.", n);
+    exit(EXIT_FAILURE);
+  }
+
+  return p;
+}
+
 /*
  * Purpose:   Convert an escape sequence to printable characters.
  * Arguments: dest - The destinations tring.
@@ -273,6 +407,7 @@ static char *
 prettyPrint(char *dest, const char *src, size_t size)
 {
   size_t idx, cnt;
+  char *start = dest;
 
   idx = cnt = 0;
 
@@ -313,30 +448,24 @@ prettyPrint(char *dest, const char *src, size_t size)
 
   /* Handle null-termination. */
   if (cnt > size)
-    dest[size] = '\0';
+    start[size] = '\0';
   else
-    dest[cnt] = '\0';
+    start[cnt] = '\0';
 
   /* Finally return the pretty-printed string. */
-  return dest;
+  return start;
 }
 
 /*
- * Purpose:   Set the terminal to raw mode.
- * Arguments: fd - The file descriptor to use.
- * Returns:   TRUE if the operation is sucessful; otherwise FALSE.
+ * Purpose:   Work out the raw mode attributes for a terminal.  Only the
+ *            modes below are changed, so that the line speed and the
+ *            like are left alone.
+ * Arguments: attr - The terminal's attributes, changed in place.
+ * Returns:   Nothing.
  */
-static int
-setRaw(int fd)
+static void
+makeRaw(struct termios *attr)
 {
-  /* Attempt to get the current terminal attributes. */
-  if (tcgetattr(fd, &termAttribsSaved) < 0) {
-    perror("tcgetattr");
-    return FALSE;
-  }
-
-  /* Set the required terminal flags for non-canonical (raw). */
-  bzero(&termAttribs, sizeof(termAttribs));
 
   /*
    * INPUT MODES:
@@ -347,22 +476,22 @@ setRaw(int fd)
    *     ISTRIP    - No strip character.
    *     IXON      - No flow control.
    */
-  termAttribs.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  attr->c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
 
   /*
    * OUTPUT MODES:
    *
    *     OPOST     - No post-processing.
    */
-  termAttribs.c_oflag &= ~(OPOST);
+  attr->c_oflag &= ~(OPOST);
 
   /*
    * CONTROL MODES:
    *
    *     CS8       - Set 8-bit characters.
    */
-  termAttribs.c_cflag &= ~(CSIZE | PARENB);
-  termAttribs.c_cflag |= (CS8);
+  attr->c_cflag &= ~(CSIZE | PARENB);
+  attr->c_cflag |= (CS8);
 
   /*
    * LOCAL MODES:
@@ -372,13 +501,32 @@ setRaw(int fd)
    *     IEXTEN    - No extended functions.
    *     ISIG      - No signal characters.
    */
-  termAttribs.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  attr->c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 
   /*
    * Let's set our return condition.  No timer, 1 byte.
    */
-  termAttribs.c_cc[VTIME] = 0;
-  termAttribs.c_cc[VMIN] = 1;
+  attr->c_cc[VTIME] = 0;
+  attr->c_cc[VMIN] = 1;
+}
+
+/*
+ * Purpose:   Set the terminal to raw mode.
+ * Arguments: fd - The file descriptor to use.
+ * Returns:   TRUE if the operation is sucessful; otherwise FALSE.
+ */
+static int
+setRaw(int fd)
+{
+  /* Attempt to get the current terminal attributes. */
+  if (tcgetattr(fd, &termAttribsSaved) < 0) {
+    perror("tcgetattr");
+    return FALSE;
+  }
+
+  /* Set the required terminal flags for non-canonical (raw). */
+  termAttribs = termAttribsSaved;
+  makeRaw(&termAttribs);
 
   /* Flush the terminal. */
   tcflush(fd, TCIFLUSH);
@@ -465,465 +613,2524 @@ readterm(char *buf, size_t size)
 }
 
 /*
- * Purpose:   Prints out a message to a terminal and then waits for input.
- * Arguments: buf   - The input buffer.
- *            size  - The size of the input buffer.
- *            fmt   - A varargs format buffer.
- *            ...   - A varargs argument list.
- * Returns:   The size of the read buffer.
+ * Purpose:   Read the monotonic clock.
+ * Arguments: None.
+ * Returns:   The time in milliseconds.
  */
-static size_t
-rawread(char *buf, size_t size, const char *fmt, ...)
+static long long
+nowMs(void)
 {
-  ssize_t rtn = -1;
-  int idx = 0;
-  int res = -1;
-  struct timeval tout;
-  fd_set fs;
-  va_list ap;
-  char *tmp;
+  struct timespec ts;
 
-  va_start(ap, fmt);
-
-  /* Print the format string to a temporary buffer. */
-  vasprintf(&tmp, fmt, ap);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-  /* Set up the timeout. */
-  tout.tv_sec = 1;
-  tout.tv_usec = 0;
+/*
+ * Purpose:   Convert a line speed to bits per second.
+ * Arguments: speed - The speed, as from cfgetospeed(3).
+ * Returns:   The bits per second, or 0 if unknown.
+ */
+static long
+lineBps(speed_t speed)
+{
+  static const struct {
+    speed_t speed;
+    long bps;
+  } speeds[] = {
+    { B50, 50 }, { B75, 75 }, { B110, 110 }, { B134, 134 },
+    { B150, 150 }, { B200, 200 }, { B300, 300 }, { B600, 600 },
+    { B1200, 1200 }, { B1800, 1800 }, { B2400, 2400 },
+    { B4800, 4800 }, { B9600, 9600 }, { B19200, 19200 },
+    { B38400, 38400 },
+#ifdef B57600
+    { B57600, 57600 },
+#endif
+#ifdef B115200
+    { B115200, 115200 },
+#endif
+#ifdef B230400
+    { B230400, 230400 },
+#endif
+  };
+  size_t idx;
 
-  /* Set up the file descriptors for select(). */
-  FD_ZERO(&fs);
-  FD_SET(STDIN_FILENO, &fs);
+  for (idx = 0; idx < sizeof(speeds) / sizeof(speeds[0]); idx++)
+    if (speeds[idx].speed == speed)
+      return speeds[idx].bps;
 
-  /* Set terminal to raw mode. */
-  setRaw(STDIN_FILENO);
+  return 0;
+}
 
-  /* Print to terminal and flush Flush buffers */
-  fprintf(ttystdout, tmp);
-  fflush(ttystdout);
+/*
+ * Purpose:   Find out what can be known about the line to a terminal
+ *            before sending it anything.
+ * Arguments: l    - The link to fill in.
+ *            name - The terminal's device file, or NULL.
+ *            attr - The terminal's attributes.
+ * Returns:   Nothing.
+ */
+static void
+linkInit(struct link *l, const char *name, const struct termios *attr)
+{
+  long obps, ibps;
 
-  /* Loop here while waiting for input. */
-  while (res != 0 || res == EINTR) {  
-    res = select(STDIN_FILENO + 1, &fs, NULL, NULL, &tout);
-    if (FD_ISSET(STDIN_FILENO, &fs) != 0) {
-      rtn = read(STDIN_FILENO, buf + idx, (size_t)1);
+  l->rtt = -1;
 
-      if (rtn > 0)
-        idx += rtn;
-        
-      if (idx >= size) {
-        idx = size;
-        break;
-      }
-    }
+  /*
+   * A pseudo-terminal's speed means nothing; the time that matters
+   * is however far away its other end is.
+   */
+  if (name != NULL &&
+      (strncmp(name, "/dev/pts/", 9) == 0 ||
+       strncmp(name, "/dev/ttyp", 9) == 0 ||
+       strncmp(name, "/dev/ttys", 9) == 0))
+  {
+    l->charUs = 0;
+    return;
   }
 
-  /* Restore the terminal. */
-  setPrevious(STDIN_FILENO);
+  /* Go by the slower direction, at ten bits a character. */
+  obps = lineBps(cfgetospeed(attr));
+  ibps = lineBps(cfgetispeed(attr));
+  if (obps == 0 || (ibps > 0 && ibps < obps))
+    obps = ibps;
 
-  /* If we have -D, we get to pretty-print things */
-  if (dflag) {
-    char *pretty;
+  l->charUs = (obps > 0) ? 10000000L / obps : -1;
+}
 
-    if (idx > 0) {
-      pretty = xmalloc(sizeof(char) * (idx * 2));
-      prettyPrint(pretty, buf, (idx * 2));
-    }
+/*
+ * Purpose:   Work out how long to wait for the reply to a probe.
+ * Arguments: l      - The link to the terminal.
+ *            sent   - The length of the probe.
+ *            expect - The longest reply expected.
+ * Returns:   The wait, in milliseconds.
+ */
+static long long
+linkWait(const struct link *l, size_t sent, size_t expect)
+{
+  if (waitMs > 0)
+    return waitMs;
 
-    fprintf(stderr,
-            "%s: read %d characters: \"%s\"\n",
-            progname,
-            (idx > 0) ? idx : 0,
-            (idx > 0) ? pretty : "");
+  /* A pty's first reply shows how far away the terminal is. */
+  if (l->charUs == 0)
+    return (l->rtt < 0) ? PROBE_TIMEOUT : l->rtt * 4 + PTY_SLACK;
 
-    if (idx > 0)
-      free(pretty);
+  if (l->charUs < 0)
+    return PROBE_TIMEOUT;
 
-    fflush(stderr);
-  }
-  
-  /* We're done. */
-  return (idx > 0) ? idx : 0;
+  return LINE_LATENCY + 2 * (long long)(sent + expect) * l->charUs / 1000;
 }
 
-/* }}} */
-/* ================================================================== */
+/*
+ * Purpose:   Work out how long to wait for the rest of a burst's
+ *            replies once the first is in.
+ * Arguments: l      - The link to the terminal.
+ *            expect - The longest of the remaining replies.
+ * Returns:   The wait, in milliseconds.
+ */
+static long long
+linkSettle(const struct link *l, size_t expect)
+{
+  long long settle = PROBE_SETTLE;
 
-/* ================================================================== */
-/* {{{ Terminal detection: */
+  /* Slow lines need longer just to carry the replies. */
+  if (l->charUs > 0 && 2 * (long long)expect * l->charUs / 1000 > settle)
+    settle = 2 * (long long)expect * l->charUs / 1000;
 
-/* ------------------------------------------------------------------ */
-/* {{{ Wyse routines: */
+  if (waitMs > 0 && waitMs < settle)
+    settle = waitMs;
+
+  return settle;
+}
 
 /*
- * Purpose:   Attempt to identify a Wyse terminal.
- * Arguments: None.
- * Returns:   Nothing.
+ * Purpose:   Find the first reply in what a probe burst has brought
+ *            back.
+ * Arguments: buf  - The replies.
+ *            len  - The length of the replies.
+ *            rlen - Set to the length of the reply.
+ * Returns:   The kind of reply (see REPLY_*), or REPLY_NONE if it has
+ *            not fully arrived.
  */
-static void 
-identWyse(void)
+static int
+nextReply(const char *buf, size_t len, size_t *rlen)
 {
-  char ctlseq[] = { 0x1b, ' ', 0x00 };   /* Terminal ID */
-  char result[128] = { 0 };
-  int size = -1;
+  size_t idx;
 
-  /* Flush the tty. */
-  fflush(ttystdout);
+  if (len == 0)
+    return REPLY_NONE;
 
-  /* Write the control sequence. */
-  if ((size = rawread(result, 128, "%s", ctlseq)) == 0) {
-    /* No luck. */
-    gotTerm = FALSE;
-  } else {
-    snprintf(term, 128, "wy%s", result);
-    gotTerm = TRUE;
-    termType = TERM_WYSE;
+  if (buf[0] != 0x1b) {
+    /* Wyse terminals answer with their model number and a CR. */
+    for (idx = 0; idx < len; idx++) {
+      if (buf[idx] == '\r') {
+        *rlen = idx + 1;
+        return REPLY_WYSE;
+      }
+    }
+    return REPLY_NONE;
   }
 
-  /* IF we're verbose, then display what we found. */
-  if (gotTerm && vflag) {
-    fprintf(stderr, 
-            "%s: WYSE terminal response \"%s\"\n",
-            progname,
-            term);
-    fflush(stderr);
+  if (len < 2)
+    return REPLY_NONE;
+
+  /* A VT52 answers DECID with ESC / and a single letter. */
+  if (buf[1] == '/') {
+    *rlen = 3;
+    return (len >= 3) ? REPLY_VT52 : REPLY_NONE;
+  }
+
+  /* Anything else is skipped a byte at a time. */
+  if (buf[1] != '[') {
+    *rlen = 1;
+    return REPLY_JUNK;
+  }
+
+  for (idx = 2; idx < len; idx++) {
+    if (buf[idx] >= 0x40 && buf[idx] <= 0x7e) {
+      *rlen = idx + 1;
+      return REPLY_DA;
+    }
   }
+
+  return REPLY_NONE;
 }
 
 /*
- * Purpose:   Attempt to find the number of lines and columns.
- * Arguments: None.
- * Returns:   Nothing.
+ * Purpose:   Decide whether every reply a probe burst can bring back
+ *            from one terminal has arrived.
+ * Arguments: buf - The replies so far.
+ *            len - The length of the replies.
+ * Returns:   TRUE if no more replies are expected; otherwise FALSE.
  */
-static void
-sizeWyse(void)
+static int
+burstDone(const char *buf, size_t len)
 {
-  /*
-   * I have no idea how to do this... anyone have a Wyse manual that
-   * details all the control sequences?
-   */
-}
+  size_t rlen;
+  int kind, nda = 0;
 
-/* }}} */
-/* ------------------------------------------------------------------ */
+  while ((kind = nextReply(buf, len, &rlen)) != REPLY_NONE) {
+    /* A VT52 answers only DECID; a Wyse ignores the ANSI probes. */
+    if (kind == REPLY_VT52 || (kind == REPLY_WYSE && burstWant == 0))
+      return TRUE;
 
-/* ------------------------------------------------------------------ */
-/* {{{ ANSI routines: */
+    /* Other DEC terminals answer both DA and DECID. */
+    if (kind == REPLY_DA && ++nda == burstWant)
+      return TRUE;
+
+    buf += rlen;
+    len -= rlen;
+  }
+
+  return FALSE;
+}
 
 /*
- * Purpose:   Attempt to identify an ANSI/DEC terminal.
- * Arguments: None.
- * Returns:   Nothing.
+ * Purpose:   Find the first control sequence or control string in what
+ *            the capability burst has brought back.
+ * Arguments: buf  - The replies.
+ *            len  - The length of the replies.
+ *            rlen - Set to the length of what was found.
+ * Returns:   '[' for a control sequence (CSI), 'P' for a device
+ *            control string (DCS), ']' for an operating system
+ *            command (OSC), -1 for bytes that are none of these, or
+ *            0 if nothing has fully arrived.
  */
-static void
-identANSI(void)
+static int
+nextCap(const char *buf, size_t len, size_t *rlen)
 {
-  char DECID[] = { 0x1b, 'Z', 0x00 };
-  char DECDA[] = { 0x1b, '[', '0', 'c', 0x00 };
-  char result[128] = { 0 };
-  int size = -1;
+  size_t idx;
 
-  /*
-   * This is a bit crazy-go-nuts.  For VT100s and below, we can use
-   * DECID to ascertain the terminal ID, but this is not
-   * forward-compatible with newer terminals.  For those we have to
-   * obtain the device attributes.
-   *
-   * There is a possiblity of some devices understanding both DECID
-   * and DA, so we want to send DA first.  If we get a response from
-   * DA we can deal with that, resorting to DECID only if we're still
-   * at a loss as to what terminal we are.  This way we avoid multiple
-   * responses.
-   */
+  if (len == 0)
+    return 0;
 
-  /* Ok, so check for the primary device attributes response. */
-  if ((size = rawread(result, 128, "%s", DECDA)) == 0) {
-    /* No device attributes... so try DECID. */
-    if ((size = rawread(result, 128, "%s", DECID)) == 0) {
-      /* No DECID either. */
-      gotTerm = FALSE;
-      return;
-    }
+  if (buf[0] != 0x1b) {
+    *rlen = 1;
+    return -1;
   }
 
-  /*
-   * Now we should have a resonse of some sort to check against the
-   * table of DEC terminal IDs.
-   */
-  {
-    int idx = 0;
+  if (len < 2)
+    return 0;
 
-    for (idx = 0; idx < (sizeof(ANSI) / sizeof(ANSI[0])); idx++) {
-      if (strncmp(result, ANSI[idx].bytes, strlen(ANSI[idx].bytes)) == 0) {
-        /* Bingo. */
-        strncpy(term, ANSI[idx].terminal, strlen(ANSI[idx].terminal));
-        termType = TERM_ANSI;
-        gotTerm = TRUE;
-        break;
+  switch (buf[1]) {
+    case '[':   /* Ended by a final byte. */
+      for (idx = 2; idx < len; idx++) {
+        if (buf[idx] >= 0x40 && buf[idx] <= 0x7e) {
+          *rlen = idx + 1;
+          return '[';
+        }
       }
-    }
-
-    /* If we're verbose, report what we have. */
-    if (gotTerm & vflag) {
-      char pretty[128] = { 0 };
-
-      prettyPrint(pretty, result, 128);
-      fprintf(stderr,
-              "%s: ANSI terminal response \"%s\" mapped to \"%s\"\n",
-              progname,
-              pretty,
-              term);
-      fflush(stderr);
-    }
+      return 0;
+    case 'P':   /* Ended by ST, or BEL for an OSC. */
+    case ']':
+      for (idx = 2; idx < len; idx++) {
+        if (buf[idx] == 0x07 && buf[1] == ']') {
+          *rlen = idx + 1;
+          return ']';
+        }
+        if (buf[idx] == 0x1b && idx + 1 < len && buf[idx + 1] == '\\') {
+          *rlen = idx + 2;
+          return buf[1];
+        }
+      }
+      return 0;
+    default:
+      *rlen = 2;
+      return -1;
   }
 }
 
 /*
- * Purpose:   Attempt to find the number of rows/columns.
- * Arguments: None.
- * Returns:   Nothing.
+ * Purpose:   Decide whether the replies to the capability burst are
+ *            all in, which they are once primary DA has answered.
+ * Arguments: buf - The replies so far.
+ *            len - The length of the replies.
+ * Returns:   TRUE if no more replies are expected; otherwise FALSE.
  */
-static void
-sizeANSI(void)
+static int
+capsDone(const char *buf, size_t len)
 {
-  /*
-   * This series of control sequences attempts to compute the size of
-   * the terminal display area.  The commands are:
-   *
-   * 1)   Save the current cursor position (DECSC)
-   * 2)   Move the cursor to 999,999 (CUP)
-   * 3)   Ascertain the current cursor position (CPR)
-   * 4)   Restore the saved cursor position (DECRC)
-   *
-   * This should result in the maximum number of addressable lines and
-   * columns being returned by the terminal.
-   */
-  char ctlseq[] = {
-    0x1b, '7',                                              /* DECSC */
-    0x1b, '[', '9', '9', '9', ';', '9', '9', '9', 'H',      /* CUP */
-    0x1b, '[', '6', 'n',                                    /* CPR */
-    0x1b, '8', 0x00                                         /* DECRC */
-  };
-  char result[128] = { 0 };
-  int size = -1;
+  size_t rlen;
+  int kind;
 
-  /* Flush the tty. */
-  fflush(ttystdout);
+  while ((kind = nextCap(buf, len, &rlen)) != 0) {
+    if (kind == '[' && buf[rlen - 1] == 'c' && buf[2] == '?')
+      return TRUE;
 
-  /* Write the control sequence. */
-  if ((size = rawread(result, 128, "%s", ctlseq)) > -1) {
-    /* TODO... parse the result. */
+    buf += rlen;
+    len -= rlen;
   }
+
+  return FALSE;
 }
 
-/* }}} */
-/* ------------------------------------------------------------------ */
+/*
+ * Purpose:   Decide whether a reply has fully arrived.
+ * Arguments: buf  - The reply so far.
+ *            len  - The length of the reply so far.
+ *            end  - What ends the reply: REPLY_* or a final byte.
+ * Returns:   TRUE if the reply is complete; otherwise FALSE.
+ */
+static int
+replyDone(const char *buf, size_t len, int end)
+{
+  size_t idx;
 
-/* ------------------------------------------------------------------ */
-/* {{{ HP routines: */
+  if (len == 0)
+    return FALSE;
+
+  if (end == REPLY_BURST)
+    return burstDone(buf, len);
+
+  if (end == REPLY_CAPS)
+    return capsDone(buf, len);
+
+  if (end != REPLY_DA)
+    return buf[len - 1] == end;
+
+  /* A VT52 answers DECID with ESC / and a single letter. */
+  if (buf[0] == 0x1b && len >= 2 && buf[1] == '/')
+    return len >= 3;
+
+  /* Otherwise it is a control sequence ended by a final byte. */
+  if (buf[0] != 0x1b || len < 3 || buf[1] != '[')
+    return FALSE;
+
+  for (idx = 2; idx < len; idx++)
+    if (buf[idx] >= 0x40 && buf[idx] <= 0x7e)
+      return TRUE;
+
+  return FALSE;
+}
 
 /*
- * Purpose:   Attempt to identify a HP termninal.
- * Arguments: None.
+ * Purpose:   Pretty-print a reply when debugging (-D).
+ * Arguments: who - The device the reply came from, or NULL for ours.
+ *            buf - The reply.
+ *            len - The length of the reply.
  * Returns:   Nothing.
  */
 static void
-identHP(void)
+showReply(const char *who, const char *buf, size_t len)
 {
-  char ctlseq[] = { 0x1b, '*', 's', '1', '^', 0 };
-  char result[128] = { 0 };
-  int size = -1;
+  char *pretty = NULL;
 
-  /* Flush the tty. */
-  fflush(ttystdout);
+  if (!dflag)
+    return;
 
-  /* Attempt to read a reply. */
-  if ((size = rawread(result, 128, "%s", ctlseq)) == 0) {
-    /* Terminal probably isn't a HP. */
-    gotTerm = FALSE;
-  } else {
-    /*
-     * HP terminals usually return the number or name of the
-     * terminal.  I do not have any real HP terminals that I can test
-     * for responses, so this is using Blind Guesses(tm).
-     */
+  if (len > 0) {
+    pretty = xmalloc(sizeof(char) * (len * 2 + 1));
+    prettyPrint(pretty, buf, (len * 2));
+  }
 
-    if (!isalnum(term[size])) {
-      size--;
-    }
+  fprintf(stderr,
+          "%s: %s%sread %d characters: \"%s\"\n",
+          progname,
+          who ? who : "",
+          who ? ": " : "",
+          (int)len,
+          (len > 0) ? pretty : "");
 
-    strncpy(term, result, size);
+  free(pretty);
+  fflush(stderr);
+}
+
+/*
+ * Purpose:   Signal handler for interrupt and termination.  Puts the
+ *            terminal back as it was, then dies of the signal.
+ * Arguments: signum - The signal number.
+ * Returns:   Nothing.
+ */
+static void
+handler(int signum)
+{
+  if (ttyState == TTY_RAW)
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &termAttribsSaved);
+
+  signal(signum, SIG_DFL);
+  raise(signum);
+}
+
+/*
+ * Purpose:   Put the terminal back as it was found, if need be.  Used
+ *            with atexit(3).
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+restoreTerm(void)
+{
+  setPrevious(STDIN_FILENO);
+}
+
+/*
+ * Purpose:   Sends a probe to the terminal and then waits for the
+ *            reply.  The wait stops as soon as the reply is complete,
+ *            or after PROBE_TIMEOUT if it never is.  The terminal is
+ *            put into raw mode by the first probe and stays there
+ *            until `setPrevious'.
+ * Arguments: buf   - The input buffer.
+ *            size  - The size of the input buffer.
+ *            end   - What ends the reply (see `replyDone').
+ *            probe - The probe to send.
+ *            plen  - The length of the probe.
+ *            expect - The longest reply expected (see `linkWait').
+ * Returns:   The size of the reply read, which is NUL-terminated.
+ */
+static size_t
+rawread(char *buf, size_t size, int end, const char *probe, size_t plen,
+        size_t expect)
+{
+  ssize_t rtn = -1;
+  size_t idx = 0;
+  long long sent, deadline, left;
+  size_t rlen;
+  int res, settling = FALSE;
+  struct pollfd pfd;
+
+  /* Set up the descriptor to wait on. */
+  pfd.fd = STDIN_FILENO;
+  pfd.events = POLLIN;
+
+  /*
+   * Set terminal to raw mode, which flushes its input.  Otherwise,
+   * throw away anything the last probe's reply left behind.
+   */
+  if (ttyState != TTY_RAW)
+    setRaw(STDIN_FILENO);
+  else
+    tcflush(STDIN_FILENO, TCIFLUSH);
+
+  /* Anything written with stdio must go first. */
+  fflush(ttystdout);
+
+  /* Send the probe in one go. */
+  if (write(fileno(ttystdout), probe, plen) != (ssize_t)plen) {
+    buf[0] = '\0';
+    return 0;
+  }
+
+  /* Leave room for the terminating NUL. */
+  size--;
+  sent = nowMs();
+  deadline = sent + linkWait(&ttyLink, plen, expect);
+
+  /* Loop here until the reply is complete or the time is up. */
+  while (idx < size && !replyDone(buf, idx, end)) {
+    if ((left = deadline - nowMs()) < 0)
+      left = 0;
+
+    if ((res = poll(&pfd, 1, (int)left)) < 0 && errno == EINTR)
+      continue;
+
+    if (res <= 0)
+      break;
+
+    /* Take whatever has arrived; replies come in one burst. */
+    if ((rtn = read(STDIN_FILENO, buf + idx, size - idx)) <= 0)
+      break;
+    idx += rtn;
+
+    /* The first reply on a pty times the ones after it. */
+    if (ttyLink.charUs == 0 && ttyLink.rtt < 0)
+      ttyLink.rtt = nowMs() - sent;
+
+    /* Replies to the rest of a burst follow close behind the first. */
+    if (end == REPLY_BURST && !settling && nextReply(buf, idx, &rlen)) {
+      settling = TRUE;
+      if (deadline > nowMs() + linkSettle(&ttyLink, BURST_REPLY))
+        deadline = nowMs() + linkSettle(&ttyLink, BURST_REPLY);
+    }
+  }
+  buf[idx] = '\0';
+
+  /* If we have -D, we get to pretty-print things */
+  showReply(NULL, buf, idx);
+
+  /* We're done. */
+  return idx;
+}
+
+/* }}} */
+/* ================================================================== */
+
+/* ================================================================== */
+/* {{{ Terminal database: */
+
+/*
+ * The terminal database maps replies to terminal types for every
+ * family at once.  It is written as text, one signature per line:
+ *
+ *     # family  reply          terminal
+ *     ansi      \E[?62;        vt220
+ *     wyse      60             wy60
+ *     hp        2392A          hp2392
+ *
+ * where the reply may use \E (escape), \r, \n, \s (space), \\, \xHH
+ * and ^X.  `ttytype -B' compiles this into a trie laid out as below,
+ * which is mapped into memory and walked once per reply to find the
+ * longest signature the reply starts with.
+ *
+ *     dbHeader
+ *     dbNode[nodes]       - In breadth-first order, so the children
+ *                           of a node are consecutive and sorted.
+ *     char[strsize]       - Terminal names, starting with "".
+ */
+typedef struct {
+  uint32_t magic;                       /* TERMDB_MAGIC. */
+  uint32_t version;                     /* TERMDB_VERSION. */
+  uint32_t nodes;                       /* Number of nodes. */
+  uint32_t strsize;                     /* Size of the names. */
+} dbHeader;
+
+typedef struct {
+  uint32_t first;                       /* First child. */
+  uint16_t count;                       /* Number of children. */
+  uint8_t byte;                         /* Byte leading here. */
+  uint8_t family;                       /* TERM_*, if a signature. */
+  uint32_t name;                        /* Offset of the name, or 0. */
+} dbNode;
+
+/* The mapped database. */
+static struct {
+  int tried;                            /* TRUE once it was looked for. */
+  const dbNode *nodes;                  /* The nodes, or NULL. */
+  uint32_t count;                       /* The number of nodes. */
+  const char *strings;                  /* The names. */
+  size_t size;                          /* Size of the mapping. */
+} db;
+
+/* A node of the trie while it is being built. */
+typedef struct {
+  int first;                            /* First child, or -1. */
+  int next;                             /* Next sibling, or -1. */
+  int family;                           /* TERM_*, if a signature. */
+  uint32_t name;                        /* Offset of the name, or 0. */
+  unsigned char byte;                   /* Byte leading here. */
+} dbBuild;
+
+/*
+ * Purpose:   Decode the escapes in a database signature.
+ * Arguments: dest - Where to put the result.
+ *            src  - The signature as written.
+ *            size - The size of `dest'.
+ * Returns:   The length of the result, or 0 if it is empty or too
+ *            long.
+ */
+static size_t
+dbUnescape(unsigned char *dest, const char *src, size_t size)
+{
+  size_t len = 0;
+  int ch, n;
+
+  while (*src != '\0') {
+    ch = (unsigned char)*src++;
+
+    if (ch == '^' && *src != '\0') {
+      ch = toupper((unsigned char)*src++) & 0x1f;
+    } else if (ch == '\\' && *src != '\0') {
+      switch ((ch = *src++)) {
+      case 'E': case 'e': ch = 0x1b; break;
+      case 'r': ch = '\r'; break;
+      case 'n': ch = '\n'; break;
+      case 's': ch = ' '; break;
+      case 'x':
+        for (n = 0, ch = 0; n < 2 && isxdigit((unsigned char)*src); n++)
+          ch = ch * 16 + (isdigit((unsigned char)*src) ?
+                          *src++ - '0' : tolower(*src++) - 'a' + 10);
+        break;
+      default:
+        break;
+      }
+    }
+
+    if (len == size)
+      return 0;
+    dest[len++] = ch;
+  }
+
+  return len;
+}
+
+/*
+ * Purpose:   Compile a text terminal database into a trie, written to
+ *            the standard output.
+ * Arguments: path - The text database.
+ * Returns:   EXIT_SUCCESS, or EXIT_FAILURE on error.
+ */
+static int
+dbCompile(const char *path)
+{
+  FILE *fp;
+  char line[256], *fam, *sig, *name;
+  unsigned char key[64];
+  dbBuild *nodes = NULL;
+  char *strings = NULL;
+  int *order, nnodes = 1, nalloc = 0, lineno = 0, family, cur, *pp, idx;
+  uint32_t strsize = 1, stralloc = 0;
+  size_t klen, k;
+  dbHeader hdr;
+  dbNode out;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    perrorf("%s: %s", progname, path);
+    return EXIT_FAILURE;
+  }
+
+  /* The root, and the empty name meaning no terminal. */
+  nalloc = 256;
+  nodes = xmalloc(nalloc * sizeof(dbBuild));
+  bzero(&nodes[0], sizeof(dbBuild));
+  nodes[0].first = nodes[0].next = -1;
+  stralloc = 1024;
+  strings = xmalloc(stralloc);
+  strings[0] = '\0';
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    lineno++;
+
+    if ((fam = strtok(line, " \t\r\n")) == NULL || *fam == '#')
+      continue;
+    sig = strtok(NULL, " \t\r\n");
+    name = strtok(NULL, " \t\r\n");
+
+    if (strcmp(fam, "ansi") == 0)
+      family = TERM_ANSI;
+    else if (strcmp(fam, "hp") == 0)
+      family = TERM_HP;
+    else if (strcmp(fam, "wyse") == 0)
+      family = TERM_WYSE;
+    else
+      family = TERM_UNKNOWN;
+
+    if (family == TERM_UNKNOWN || sig == NULL || name == NULL ||
+        (klen = dbUnescape(key, sig, sizeof(key))) == 0 ||
+        strlen(name) >= sizeof(term))
+    {
+      fprintf(stderr, "%s: %s:%d: bad signature\n", progname, path, lineno);
+      fclose(fp);
+      return EXIT_FAILURE;
+    }
+
+    /* Walk down the trie, adding what is missing in byte order. */
+    for (cur = 0, k = 0; k < klen; k++) {
+      for (pp = &nodes[cur].first;
+           *pp != -1 && nodes[*pp].byte < key[k];
+           pp = &nodes[*pp].next)
+        ;
+
+      if (*pp == -1 || nodes[*pp].byte != key[k]) {
+        if (nnodes == nalloc) {
+          nalloc *= 2;
+          nodes = xrealloc(nodes, nalloc * sizeof(dbBuild));
+        }
+        bzero(&nodes[nnodes], sizeof(dbBuild));
+        nodes[nnodes].first = -1;
+        nodes[nnodes].next = *pp;
+        nodes[nnodes].byte = key[k];
+        *pp = nnodes++;
+      }
+
+      cur = *pp;
+    }
+
+    /* A later signature replaces an earlier one. */
+    while (strsize + strlen(name) + 1 > stralloc) {
+      stralloc *= 2;
+      strings = xrealloc(strings, stralloc);
+    }
+    nodes[cur].family = family;
+    nodes[cur].name = strsize;
+    strcpy(strings + strsize, name);
+    strsize += strlen(name) + 1;
+  }
+
+  fclose(fp);
+
+  /*
+   * Lay the nodes out breadth first, so that each node's children
+   * follow one another in byte order.
+   */
+  order = xmalloc(nnodes * sizeof(int));
+  order[0] = 0;
+  for (idx = 0, k = 1; idx < nnodes; idx++)
+    for (cur = nodes[order[idx]].first; cur != -1; cur = nodes[cur].next)
+      order[k++] = cur;
+
+  hdr.magic = TERMDB_MAGIC;
+  hdr.version = TERMDB_VERSION;
+  hdr.nodes = nnodes;
+  hdr.strsize = strsize;
+  fwrite(&hdr, sizeof(hdr), 1, stdout);
+
+  for (idx = 0, k = 1; idx < nnodes; idx++) {
+    bzero(&out, sizeof(out));
+    out.byte = nodes[order[idx]].byte;
+    out.family = nodes[order[idx]].family;
+    out.name = nodes[order[idx]].name;
+    out.first = k;
+    for (cur = nodes[order[idx]].first; cur != -1; cur = nodes[cur].next)
+      out.count++;
+    k += out.count;
+    fwrite(&out, sizeof(out), 1, stdout);
+  }
+
+  fwrite(strings, strsize, 1, stdout);
+
+  free(order);
+  free(strings);
+  free(nodes);
+
+  if (fflush(stdout) == EOF || ferror(stdout)) {
+    perrorf("%s: writing database", progname);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Purpose:   Map the compiled terminal database, checking that it is
+ *            sound so that it need not be checked while matching.
+ * Arguments: None.
+ * Returns:   TRUE if there is a database; otherwise FALSE.
+ */
+static int
+dbOpen(void)
+{
+  const char *path = getenv("TTYTYPE_DB");
+  const dbHeader *hdr;
+  struct stat st;
+  uint32_t idx;
+  char *map;
+  int fd;
+
+  if (db.tried)
+    return db.nodes != NULL;
+  db.tried = TRUE;
+
+  if (path == NULL || *path == '\0')
+    path = TERMDB;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return FALSE;
+
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(dbHeader)) {
+    close(fd);
+    return FALSE;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return FALSE;
+
+  hdr = (const dbHeader *)map;
+  if (hdr->magic != TERMDB_MAGIC || hdr->version != TERMDB_VERSION ||
+      hdr->nodes == 0 || hdr->strsize == 0 ||
+      st.st_size != (off_t)(sizeof(dbHeader) +
+                            (size_t)hdr->nodes * sizeof(dbNode) +
+                            hdr->strsize))
+  {
+    munmap(map, st.st_size);
+    return FALSE;
+  }
+
+  db.nodes = (const dbNode *)(map + sizeof(dbHeader));
+  db.count = hdr->nodes;
+  db.strings = (const char *)(db.nodes + db.count);
+  db.size = st.st_size;
+
+  for (idx = 0; idx < db.count; idx++) {
+    if ((uint64_t)db.nodes[idx].first + db.nodes[idx].count > db.count ||
+        db.nodes[idx].name >= hdr->strsize ||
+        db.strings[hdr->strsize - 1] != '\0')
+    {
+      munmap(map, st.st_size);
+      db.nodes = NULL;
+      return FALSE;
+    }
+  }
+
+  if (dflag) {
+    fprintf(stderr,
+            "%s: using terminal database %s (%u nodes)\n",
+            progname,
+            path,
+            (unsigned)db.count);
+    fflush(stderr);
+  }
+
+  return TRUE;
+}
+
+/*
+ * Purpose:   Find the longest signature in the database that a reply
+ *            starts with, or given a family, that family's signature
+ *            that is the whole reply.  ANSI replies carry options
+ *            after the part that names the terminal; Wyse and HP
+ *            replies are the model and nothing else.
+ * Arguments: reply  - The reply.
+ *            len    - The length of the reply.
+ *            want   - The family being probed (TERM_*) if the whole
+ *                     reply must match, or TERM_UNKNOWN.
+ *            family - With TERM_UNKNOWN, set to the family of the
+ *                     terminal found; otherwise unused.
+ * Returns:   The terminal type, or NULL if there is none.
+ */
+static const char *
+dbMatch(const char *reply, size_t len, int want, int *family)
+{
+  const dbNode *node, *best = NULL;
+  uint32_t lo, hi, mid;
+  size_t idx;
+
+  if (!dbOpen())
+    return NULL;
+
+  for (node = db.nodes, idx = 0; idx < len; idx++) {
+    /* Children are in byte order. */
+    lo = node->first;
+    hi = lo + node->count;
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (db.nodes[mid].byte < (unsigned char)reply[idx])
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+    if (lo == node->first + node->count ||
+        db.nodes[lo].byte != (unsigned char)reply[idx])
+      break;
+
+    node = &db.nodes[lo];
+    if (node->name != 0)
+      best = node;
+  }
+
+  if (want != TERM_UNKNOWN) {
+    if (idx < len || best != node || best->family != want)
+      return NULL;
+    return db.strings + best->name;
+  }
+
+  if (best == NULL)
+    return NULL;
+
+  *family = best->family;
+  return db.strings + best->name;
+}
+
+/* }}} */
+/* ================================================================== */
+
+/* ================================================================== */
+/* {{{ Terminal detection: */
+
+/* ------------------------------------------------------------------ */
+/* {{{ Wyse routines: */
+
+/*
+ * Purpose:   Take the terminal type from a Wyse identification reply.
+ * Arguments: reply - The reply, ended by a CR.
+ * Returns:   Nothing.
+ */
+static void
+setWyse(const char *reply)
+{
+  size_t len = strcspn(reply, "\r");
+  const char *name;
+
+  /* The reply is the model, so make a name of it if it is unknown. */
+  if ((name = dbMatch(reply, len, TERM_WYSE, NULL)) != NULL)
+    snprintf(term, sizeof(term), "%s", name);
+  else
+    snprintf(term, sizeof(term), "wy%.*s", (int)len, reply);
+  gotTerm = TRUE;
+  termType = TERM_WYSE;
+
+  /* IF we're verbose, then display what we found. */
+  if (vflag) {
+    fprintf(stderr, 
+            "%s: WYSE terminal response \"%s\"\n",
+            progname,
+            term);
+    fflush(stderr);
+  }
+}
+
+/*
+ * Purpose:   Attempt to find the number of lines and columns.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+sizeWyse(void)
+{
+  /*
+   * I have no idea how to do this... anyone have a Wyse manual that
+   * details all the control sequences?
+   */
+}
+
+/* }}} */
+/* ------------------------------------------------------------------ */
+
+/* ------------------------------------------------------------------ */
+/* {{{ ANSI routines: */
+
+/*
+ * Purpose:   Look up a DA or DECID reply in the table of DEC terminal
+ *            IDs.
+ * Arguments: buf - The reply.
+ *            len - The length of the reply.
+ * Returns:   Nothing.
+ */
+static void
+setANSI(const char *buf, size_t len)
+{
+  char reply[128];
+  const char *name;
+  int idx = 0, family;
+
+  snprintf(reply, sizeof(reply), "%.*s", (int)len, buf);
+
+  /* The database knows more terminals than the built-in table. */
+  if ((name = dbMatch(buf, len, TERM_UNKNOWN, &family)) != NULL) {
+    snprintf(term, sizeof(term), "%s", name);
+    termType = family;
     gotTerm = TRUE;
-    termType = TERM_HP;
   }
-  
+
+  for (idx = 0; !gotTerm && ANSI[idx].terminal != NULL; idx++) {
+    if (strncmp(reply, ANSI[idx].bytes, strlen(ANSI[idx].bytes)) == 0) {
+      /* Bingo. */
+      strncpy(term, ANSI[idx].terminal, sizeof(term) - 1);
+      termType = TERM_ANSI;
+      gotTerm = TRUE;
+      break;
+    }
+  }
+
+  /* If we're verbose, report what we have. */
+  if (gotTerm & vflag) {
+    char pretty[128] = { 0 };
+
+    prettyPrint(pretty, reply, sizeof(pretty) - 1);
+    fprintf(stderr,
+            "%s: ANSI terminal response \"%s\" mapped to \"%s\"\n",
+            progname,
+            pretty,
+            term);
+    fflush(stderr);
+  }
+}
+
+/*
+ * Purpose:   Take the screen size from the replies to `sizeANSI'.
+ * Arguments: buf - The replies.
+ *            len - The length of the replies.
+ * Returns:   TRUE if a believable size was found; otherwise FALSE.
+ */
+static int
+parseSizeANSI(const char *buf, size_t len)
+{
+  int args[3], nargs, rows = -1, cols = -1;
+  size_t rlen, idx;
+  char fin;
+
+  while (len > 0) {
+    if (nextReply(buf, len, &rlen) != REPLY_DA) {
+      buf++;
+      len--;
+      continue;
+    }
+
+    /* Collect the numeric arguments of ESC [ a ; b ; c <fin>. */
+    fin = buf[rlen - 1];
+    nargs = 0;
+    args[0] = args[1] = args[2] = 0;
+    for (idx = 2; idx < rlen - 1; idx++) {
+      if (isdigit((unsigned char)buf[idx]) && args[nargs] < 100000)
+        args[nargs] = args[nargs] * 10 + (buf[idx] - '0');
+      else if (buf[idx] == ';' && ++nargs == 3)
+        break;
+    }
+    nargs++;
+
+    /* XTWINOPS gives the text area exactly; CPR only where we got to. */
+    if (fin == 't' && nargs == 3 && args[0] == 8) {
+      rows = args[1];
+      cols = args[2];
+      break;
+    }
+    if (fin == 'R' && nargs == 2) {
+      rows = args[0];
+      cols = args[1];
+    }
+
+    buf += rlen;
+    len -= rlen;
+  }
+
+  /* A terminal that did not stop the cursor at its edge is no help. */
+  if (rows < 1 || cols < 1 || rows >= 999 || cols >= 999)
+    return FALSE;
+
+  lines = rows;
+  columns = cols;
+  return TRUE;
+}
+
+/*
+ * Purpose:   Attempt to find the number of rows/columns.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+sizeANSI(void)
+{
+  /*
+   * This series of control sequences attempts to compute the size of
+   * the terminal display area.  The commands are:
+   *
+   * 1)   Ask for the size of the text area (XTWINOPS 18)
+   * 2)   Save the current cursor position (DECSC)
+   * 3)   Move the cursor to 999,999 (CUP)
+   * 4)   Ascertain the current cursor position (CPR)
+   * 5)   Restore the saved cursor position (DECRC)
+   *
+   * Terminals that do not know XTWINOPS ignore it.  Those that do
+   * answer it first, so the CPR reply, which should result in the
+   * maximum number of addressable lines and columns, always comes
+   * last and ends the read.
+   */
+  static const char ctlseq[] = {
+    0x1b, '[', '1', '8', 't',                               /* XTWINOPS */
+    0x1b, '7',                                              /* DECSC */
+    0x1b, '[', '9', '9', '9', ';', '9', '9', '9', 'H',      /* CUP */
+    0x1b, '[', '6', 'n',                                    /* CPR */
+    0x1b, '8', 0x00                                         /* DECRC */
+  };
+  char result[128] = { 0 };
+  int size = -1;
+
+  /* Write the control sequence. */
+  if ((size = rawread(result, 128, 'R', ctlseq, sizeof(ctlseq) - 1,
+                      32)) > 0 &&
+      parseSizeANSI(result, size) && dflag)
+  {
+    fprintf(stderr,
+            "%s: ANSI reports size as %d lines, %d columns\n",
+            progname,
+            lines,
+            columns);
+    fflush(stderr);
+  }
+}
+
+/* }}} */
+/* ------------------------------------------------------------------ */
+
+/* ------------------------------------------------------------------ */
+/* {{{ Capability burst: */
+
+/*
+ * Private modes asked about with DECRQM, and the names they go by in
+ * the capability record.
+ */
+static const struct {
+  int mode;
+  const char *name;
+} capModes[] = {
+  { 1000, "mouse" },                    /* Mouse button tracking. */
+  { 1004, "focus" },                    /* Focus in/out reports. */
+  { 1006, "sgrmouse" },                 /* SGR mouse encoding. */
+  { 2004, "paste" },                    /* Bracketed paste. */
+  { 2026, "sync" },                     /* Synchronised output. */
+  { 0, NULL }
+};
+
+/*
+ * Purpose:   Add a field to a capability record, leaving out anything
+ *            that would upset the record or a shell.
+ * Arguments: rec  - The record.
+ *            size - The size of the record.
+ *            name - The field's name.
+ *            val  - The field's value, or NULL for a flag.
+ *            vlen - The length of the value.
+ * Returns:   Nothing.
+ */
+static void
+capAdd(char *rec, size_t size, const char *name, const char *val,
+       size_t vlen)
+{
+  size_t len = strlen(rec);
+  size_t idx;
+
+  len += snprintf(rec + len, size - len, "%s%s%s",
+                  (len > 0) ? ":" : "", name, val ? "=" : "");
+
+  for (idx = 0; val && idx < vlen && len + 1 < size; idx++)
+    if (isprint((unsigned char)val[idx]) && val[idx] != ':' &&
+        val[idx] != '\'' && val[idx] != '\\')
+      rec[len++] = val[idx];
+
+  if (len < size)
+    rec[len] = '\0';
+}
+
+/*
+ * Purpose:   Find out what an ANSI terminal can do beyond its family:
+ *            its model and version, the modes in `capModes', direct
+ *            colour, and its background colour.  All of the queries
+ *            go in one burst, ended by primary DA so that the end of
+ *            the replies is known; terminals ignore those they do not
+ *            understand.
+ * Arguments: rec  - Where to put the capability record, a list of
+ *                   name=value fields and flags separated by colons.
+ *            size - The size of the record.
+ * Returns:   Nothing.
+ */
+static void
+identCaps(char *rec, size_t size)
+{
+  static const char ctlseq[] =
+    "\033[>c"                           /* Secondary DA */
+    "\033[>0q"                          /* XTVERSION */
+    "\033[?1000$p\033[?1004$p\033[?1006$p" /* DECRQM */
+    "\033[?2004$p\033[?2026$p"
+    "\033P+q524742;5463\033\\"          /* XTGETTCAP RGB, Tc */
+    "\033]11;?\033\\"                   /* Background colour */
+    "\033[c";                           /* Primary DA */
+  char result[512] = { 0 };
+  const char *buf = result;
+  size_t len, rlen;
+  int kind, mode, state, idx, rgb = FALSE;
+
+  rec[0] = '\0';
+  len = rawread(result, sizeof(result), REPLY_CAPS, ctlseq,
+                sizeof(ctlseq) - 1, 256);
+
+  for (; (kind = nextCap(buf, len, &rlen)) != 0; buf += rlen, len -= rlen) {
+    if (kind == '[' && rlen > 3 && buf[2] == '>' && buf[rlen - 1] == 'c') {
+      /* Secondary DA: model; version; options. */
+      capAdd(rec, size, "da2", buf + 3, rlen - 4);
+    } else if (kind == '[' && buf[2] == '?' && buf[rlen - 1] == 'y') {
+      /* DECRPM: mode; state, where 0 is a mode not known. */
+      if (sscanf(buf + 3, "%d;%d$y", &mode, &state) != 2 || state == 0)
+        continue;
+      for (idx = 0; capModes[idx].name != NULL; idx++)
+        if (capModes[idx].mode == mode)
+          capAdd(rec, size, capModes[idx].name, NULL, 0);
+    } else if (kind == 'P' && rlen > 4 && buf[2] == '>' && buf[3] == '|') {
+      /* XTVERSION: the terminal's name and version. */
+      capAdd(rec, size, "version", buf + 4, rlen - 6);
+    } else if (kind == 'P' && rlen > 5 && strncmp(buf + 2, "1+r", 3) == 0) {
+      /* XTGETTCAP: only known capabilities come back with 1. */
+      rgb = TRUE;
+    } else if (kind == ']' && rlen > 5 && strncmp(buf + 2, "11;", 3) == 0) {
+      /* Background colour, as rgb:RRRR/GGGG/BBBB. */
+      const char *val = buf + 5;
+      size_t vlen = rlen - 5 - (buf[rlen - 1] == 0x07 ? 1 : 2);
+
+      if (vlen > 4 && strncmp(val, "rgb:", 4) == 0) {
+        val += 4;
+        vlen -= 4;
+      }
+      capAdd(rec, size, "bg", val, vlen);
+    }
+  }
+
+  if (rgb)
+    capAdd(rec, size, "rgb", NULL, 0);
+
+  /* If we're verbose (-v), print out what we have. */
+  if (vflag) {
+    fprintf(stderr,
+            "%s: capabilities \"%s\"\n",
+            progname,
+            rec);
+    fflush(stderr);
+  }
+}
+
+/* }}} */
+/* ------------------------------------------------------------------ */
+
+/* ------------------------------------------------------------------ */
+/* {{{ Probe burst: */
+
+/*
+ * Purpose:   Identify the terminal from the replies to a probe burst,
+ *            going with the first reply that means something.
+ * Arguments: buf  - The replies.
+ *            len  - The length of the replies.
+ *            wyse - TRUE if Wyse terminals were probed for.
+ *            ansi - TRUE if ANSI/DEC terminals were probed for.
+ * Returns:   Nothing.
+ */
+static void
+classifyBurst(const char *buf, size_t len, int wyse, int ansi)
+{
+  size_t rlen;
+  int kind;
+
+  while (!gotTerm && (kind = nextReply(buf, len, &rlen)) != REPLY_NONE) {
+    if (kind == REPLY_WYSE && wyse)
+      setWyse(buf);
+    else if ((kind == REPLY_DA || kind == REPLY_VT52) && ansi)
+      setANSI(buf, rlen);
+
+    buf += rlen;
+    len -= rlen;
+  }
+}
+
+/*
+ * Purpose:   Probe for Wyse and ANSI/DEC terminals at once.  The
+ *            probes are sent in a single write and whatever comes back
+ *            within one shared deadline is sorted out afterwards, so
+ *            detection costs one round trip rather than one timeout
+ *            per probe.  The HP probe can upset ANSI terminals and so
+ *            is never part of the burst.
+ * Arguments: wyse - TRUE to probe for Wyse terminals.
+ *            ansi - TRUE to probe for ANSI/DEC terminals.
+ * Returns:   Nothing.
+ */
+static void
+identBurst(int wyse, int ansi)
+{
+  char result[256] = { 0 };
+  char burst[16];
+  size_t len;
+
+  /*
+   * DA is sent before DECID, as some devices understand both; the
+   * DECID reply is the one relied upon only when there is no other.
+   */
+  burstWant = ansi ? 2 : 0;
+  len = snprintf(burst, sizeof(burst), "%s%s%s",
+                 wyse ? WYID : "", ansi ? DECDA : "", ansi ? DECID : "");
+  len = rawread(result, sizeof(result), REPLY_BURST, burst, len,
+                BURST_REPLY);
+
+  classifyBurst(result, len, wyse, ansi);
+}
+
+/* }}} */
+/* ------------------------------------------------------------------ */
+
+/* ------------------------------------------------------------------ */
+/* {{{ HP routines: */
+
+/*
+ * Purpose:   Take the terminal type from a HP identification reply.
+ * Arguments: result - The reply.
+ *            size   - The length of the reply.
+ * Returns:   Nothing.
+ */
+static void
+setHP(const char *result, size_t size)
+{
+  const char *name;
+
+  /*
+   * HP terminals usually return the number or name of the
+   * terminal.  I do not have any real HP terminals that I can test
+   * for responses, so this is using Blind Guesses(tm).
+   */
+  while (size > 0 && !isalnum((unsigned char)result[size - 1]))
+    size--;
+  if (size == 0)
+    return;
+  if (size >= sizeof(term))
+    size = sizeof(term) - 1;
+
+  if ((name = dbMatch(result, size, TERM_HP, NULL)) != NULL) {
+    snprintf(term, sizeof(term), "%s", name);
+  } else {
+    memcpy(term, result, size);
+    term[size] = '\0';
+  }
+  gotTerm = TRUE;
+  termType = TERM_HP;
+
   /* If we're verbose (-v), print out what we have. */
-  if (gotTerm && vflag) {
+  if (vflag) {
     fprintf(stderr,
             "%s: HP terminal response \"%s\"\n",
             progname,
-            term);
+            term);
+    fflush(stderr);
+  }  
+}
+
+/*
+ * Purpose:   Attempt to identify a HP termninal.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+identHP(void)
+{
+  char result[128] = { 0 };
+  int size = -1;
+
+  /* Attempt to read a reply. */
+  if ((size = rawread(result, 128, '\r', HPID, sizeof(HPID) - 1,
+                      HPID_REPLY)) > 0)
+    setHP(result, size);
+}
+
+/*
+ * Purpose:   Attempt to find the number of rows and columns.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+sizeHP(void)
+{
+  /*
+   * This is probably a kludge.  The control sequence crafted here
+   * simply attempts to move the cursor to some ludicrous screen
+   * position.  This will never happen, instead the cursor will
+   * deposit itself at the maximum possible extents.
+   */
+  static const char ctlseq[] = {
+    0x1b, '&', 'a', '9', '9', '9', 'c', '9', '9', '9', 'Y',
+    /*
+     * However, that is only part of the solution.  The following
+     * sequence will query the terminal for the current cursor
+     * position.
+     */
+    0x1b, '`', 0
+  };
+  const char *query = ctlseq + 11;
+  char result[128] = { 0 };
+  int size = 0;
+
+  /* Write out the query and read any result. */
+  if ((size = rawread(result, 128, 'Y', query, 2, 16)) > -1) {
+    /*
+     * Ok, so this worked... now let's try to set the cursor
+     * position.
+     */
+    if ((size = rawread(result, 128, 'Y', ctlseq,
+                        sizeof(ctlseq) - 1, 16)) > -1) {
+      /*
+       * The result is in the form of ^[&aCCCcLLLY where CCC is the
+       * number of columns and LLL is the number of lines.
+       */
+      if (result[0] == 0x1b &&
+          result[1] == '&' &&
+          result[2] == 'a')
+      {
+        char *tok, *beg = (result + 3);
+
+        tok = strtok(beg, "c");
+        columns = atoi(tok) + 1;
+
+        tok = strtok(NULL, "c");
+        lines = atoi(tok) + 1;
+
+        /* If we're debugging, print a little info. */
+        if (dflag) {
+          fprintf(stderr,
+                  "%s: HP reports size as %d lines, %d columns\n",
+                  progname,
+                  lines,
+                  columns);
+          fflush(stderr);
+        }
+      }
+    }
+  }
+}
+
+/* }}} */
+/* ------------------------------------------------------------------ */
+
+/* ------------------------------------------------------------------ */
+/* {{{ All families: */
+
+/*
+ * Purpose:   Attempt to identify the terminal.
+ * Arguments: wyse - TRUE to probe for Wyse terminals.
+ *            ansi - TRUE to probe for ANSI/DEC terminals.
+ *            hp   - TRUE to probe for HP terminals.
+ * Returns:   Nothing; `gotTerm' says whether it worked.
+ */
+static void
+identify(int wyse, int ansi, int hp)
+{
+  /* Check for Wyse and ANSI terminals together. */
+  if (!gotTerm && (wyse || ansi))
+    identBurst(wyse, ansi);
+
+  /* Lastly check for HP. */
+  if (!gotTerm && hp)
+    identHP();
+}
+
+/* }}} */
+/* ------------------------------------------------------------------ */
+
+/* ------------------------------------------------------------------ */
+/* {{{ ioctl routines: */
+
+/*
+ * Purpose:   Attempt to obtain the terminal size using ioctl.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+sizeIoctl(void)
+{
+  struct winsize w;
+
+  bzero(&w, sizeof(w));
+  ioctl(fileno(ttystdout), TIOCGWINSZ, &w);
+
+  /* Serial lines often know nothing, and say 0x0. */
+  if (w.ws_row > 0 && w.ws_col > 0) {
+    lines = w.ws_row;
+    columns = w.ws_col;
+  }
+
+  if (dflag) {
+    fprintf(stderr,
+            "%s: ioctl reports %d lines, %d columns.\n",
+            progname,
+            w.ws_row,
+            w.ws_col);
     fflush(stderr);
-  }  
+  }
 }
 
+/* }}} */
+/* ------------------------------------------------------------------ */
+
+/* ------------------------------------------------------------------ */
+/* {{{ Screen size detection: */
+
 /*
- * Purpose:   Attempt to find the number of rows and columns.
+ * Purpose:   Attempt to ascertain the size of the terminal.
  * Arguments: None.
  * Returns:   Nothing.
  */
 static void
-sizeHP(void)
+screensize(void)
 {
+
   /*
-   * This is probably a kludge.  The control sequence crafted here
-   * simply attempts to move the cursor to some ludicrous screen
-   * position.  This will never happen, instead the cursor will
-   * deposit itself at the maximum possible extents.
+   * Ask the kernel first.  When it knows the size, asking the
+   * terminal would only cost a round trip.
    */
-  char ctlseq[] = {
-    0x1b, '&', 'a', '9', '9', '9', 'c', '9', '9', '9', 'Y', 0
-  };
+  sizeIoctl();
+
   /*
-   * However, that is only part of the solution.  The following
-   * sequence will query the terminal for the current cursor position.
+   * If lines or columns is equal to -1 then the kernel does not know,
+   * so if we have a terminal, then try the size computation routine
+   * for the relevant terminal type.
    */
-  char query[] = { 0x1b, '`', 0 };
-  char result[128] = { 0 };
-  int size = 0;
+  if (gotTerm && (lines == -1 || columns == -1)) {
+    if (termType == TERM_WYSE)
+      sizeWyse();
+    else if (termType == TERM_ANSI)
+      sizeANSI();
+    else if (termType == TERM_HP)
+      sizeHP();
+  }
 
-  /* Flush the tty. */
-  fflush(ttystdout);
+  /*
+   * If lines or columns is still equal to -1 then something really
+   * failed so just use the default values.
+   */
+  if (lines == -1 || columns == -1) {
+    lines = defaultLines;
+    columns = defaultColumns;
+  }
+
+  /* If we're verbose, display some info. */
+  if (vflag) {
+    fprintf(stderr,
+            "%s: COLUMNS=%d; LINES=%d\n",
+            progname,
+            columns,
+            lines);
+    fflush(stderr);
+  }
+}
+
+/* }}} */
+/* ------------------------------------------------------------------ */
+
+/* ------------------------------------------------------------------ */
+/* {{{ Detection cache: */
+
+/*
+ * A cached result.  The key is a hash of what identifies the
+ * terminal, so that records stay small and of a fixed size.
+ */
+typedef struct {
+  unsigned int magic;                   /* CACHE_MAGIC. */
+  int termType;                         /* One of TERM_*. */
+  unsigned long long key;               /* Hash of the terminal key. */
+  long long stamp;                      /* When it was detected. */
+  int lines;                            /* Lines, or -1 if unknown. */
+  int columns;                          /* Columns, or -1 if unknown. */
+  char term[40];                        /* The terminal type. */
+} cacheRec;
+
+/*
+ * Purpose:   Work out where the cache lives, creating its directory
+ *            if need be.
+ * Arguments: path - Where to put the path.
+ *            size - The size of `path'.
+ * Returns:   TRUE if there is somewhere to keep it; otherwise FALSE.
+ */
+static int
+cachePath(char *path, size_t size)
+{
+  const char *dir = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+
+  if (dir != NULL && *dir != '\0')
+    snprintf(path, size, "%s", dir);
+  else if (home != NULL && *home != '\0')
+    snprintf(path, size, "%s/.cache", home);
+  else
+    return FALSE;
+
+  /* Only the user gets to see it. */
+  if (mkdir(path, 0700) < 0 && errno != EEXIST)
+    return FALSE;
+
+  strncat(path, "/ttytype", size - strlen(path) - 1);
+  return TRUE;
+}
+
+/*
+ * Purpose:   Compute the key for this terminal from its device, the
+ *            session, and where the session comes from.
+ * Arguments: None.
+ * Returns:   The key.
+ */
+static unsigned long long
+cacheKey(void)
+{
+  static const char *vars[] = {
+    "SSH_CONNECTION", "TMUX_PANE", "STY", "WINDOWID", NULL
+  };
+  unsigned long long hash = 14695981039346656037ULL;
+  char buf[64];
+  const char *val, *p;
+  struct stat st;
+  int idx;
+
+  bzero(&st, sizeof(st));
+  fstat(fileno(ttystdout), &st);
+  snprintf(buf, sizeof(buf), "%llu %d",
+           (unsigned long long)st.st_rdev, (int)getsid(0));
+
+  /* FNV-1a over the device and session, then the environment. */
+  for (p = buf; *p != '\0'; p++)
+    hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+
+  for (idx = 0; vars[idx] != NULL; idx++) {
+    if ((val = getenv(vars[idx])) == NULL)
+      val = "";
+    for (p = val; ; p++) {
+      hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+      if (*p == '\0')
+        break;
+    }
+  }
+
+  return hash;
+}
+
+/*
+ * Purpose:   Look for a fresh result for this terminal in the cache.
+ * Arguments: None.
+ * Returns:   TRUE if one was found, in which case `term', `termType',
+ *            `lines' and `columns' are set; otherwise FALSE.
+ */
+static int
+cacheLookup(void)
+{
+  char path[MAXPATHLEN];
+  const cacheRec *recs;
+  unsigned long long key;
+  long long now = time(NULL);
+  struct stat st;
+  size_t nrec, idx;
+  int fd, found = FALSE;
+
+  if (!cachePath(path, sizeof(path)) || (fd = open(path, O_RDONLY)) < 0)
+    return FALSE;
+
+  if (fstat(fd, &st) < 0 || st.st_size == 0 ||
+      st.st_size % sizeof(cacheRec) != 0)
+  {
+    close(fd);
+    return FALSE;
+  }
+
+  recs = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (recs == MAP_FAILED)
+    return FALSE;
+
+  key = cacheKey();
+  nrec = st.st_size / sizeof(cacheRec);
+
+  for (idx = 0; idx < nrec; idx++) {
+    if (recs[idx].magic != CACHE_MAGIC || recs[idx].key != key ||
+        now - recs[idx].stamp > CACHE_TTL || now < recs[idx].stamp)
+      continue;
+
+    snprintf(term, sizeof(term), "%s", recs[idx].term);
+    termType = recs[idx].termType;
+    lines = recs[idx].lines;
+    columns = recs[idx].columns;
+    found = TRUE;
+    break;
+  }
+
+  munmap((void *)recs, st.st_size);
+
+  if (found && vflag) {
+    fprintf(stderr,
+            "%s: cached terminal type \"%s\"\n",
+            progname,
+            term);
+    fflush(stderr);
+  }
+
+  return found;
+}
+
+/*
+ * Purpose:   Record the result for this terminal in the cache.  The
+ *            cache is rewritten to a temporary file which is then
+ *            renamed over it, so readers never see it half-written.
+ * Arguments: None.
+ * Returns:   Nothing.
+ */
+static void
+cacheStore(void)
+{
+  char path[MAXPATHLEN], tmp[MAXPATHLEN + 8];
+  cacheRec recs[CACHE_MAX], *old = MAP_FAILED;
+  unsigned long long key;
+  long long now = time(NULL);
+  struct stat st;
+  size_t nrec = 0, nold = 0, idx;
+  int fd;
+
+  if (!cachePath(path, sizeof(path)))
+    return;
+
+  key = cacheKey();
+
+  /* The new record goes first, as the most likely to be wanted. */
+  bzero(&recs[0], sizeof(recs[0]));
+  recs[0].magic = CACHE_MAGIC;
+  recs[0].termType = termType;
+  recs[0].key = key;
+  recs[0].stamp = now;
+  recs[0].lines = lines;
+  recs[0].columns = columns;
+  snprintf(recs[0].term, sizeof(recs[0].term), "%s", term);
+  nrec = 1;
+
+  /* Keep what is still fresh of the rest, newest first. */
+  if ((fd = open(path, O_RDONLY)) >= 0) {
+    if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+        st.st_size % sizeof(cacheRec) == 0)
+    {
+      nold = st.st_size / sizeof(cacheRec);
+      old = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+  }
+
+  if (old != MAP_FAILED) {
+    for (idx = 0; idx < nold && nrec < CACHE_MAX; idx++) {
+      if (old[idx].magic == CACHE_MAGIC && old[idx].key != key &&
+          now - old[idx].stamp <= CACHE_TTL && now >= old[idx].stamp)
+        recs[nrec++] = old[idx];
+    }
+    munmap(old, st.st_size);
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  if ((fd = mkstemp(tmp)) < 0)
+    return;
+
+  if (write(fd, recs, nrec * sizeof(cacheRec)) !=
+      (ssize_t)(nrec * sizeof(cacheRec)) ||
+      close(fd) < 0 || rename(tmp, path) < 0)
+  {
+    unlink(tmp);
+  }
+}
+
+/* }}} */
+/* ------------------------------------------------------------------ */
+
+/* }}} */
+/* ================================================================== */
+
+/* ================================================================== */
+/* {{{ Results: */
+
+/*
+ * Purpose:   Print the terminal type, or with -s, shell commands to set
+ *            it and the screen size.
+ * Arguments: caps - The capability record, printed with -x.
+ * Returns:   Nothing.
+ */
+static void
+printResult(const char *caps)
+{
+  if (sflag) {
+    char *shell;
 
-  /* Write out the query and read any result. */
-  if ((size = rawread(result, 128, "%s", query)) > -1) {
     /*
-     * Ok, so this worked... now let's try to set the cursor
-     * position.
+     * Allocate space for the shell then attempt to get it from the
+     * environment.
      */
-    if ((size = rawread(result, 128, "%s%s", ctlseq, query)) > -1) {
-      /*
-       * The result is in the form of ^[&aCCCcLLLY where CCC is the
-       * number of columns and LLL is the number of lines.
-       */
-      if (result[0] == 0x1b &&
-          result[1] == '&' &&
-          result[2] == 'a')
-      {
-        char *tok, *beg = (result + 3);
+    shell = xmalloc(sizeof(char) * MAXPATHLEN);
+    shell = basename((char *)getenv("SHELL"));
+
+    /*
+     * Use the `SHELL' environment variable to compute exactly how to
+     * display the values.
+     */
+    if (strncmp(shell, "csh", 3) == 0 ||
+        strncmp(shell, "tcsh", 4) == 0)
+    {
+      /* C-Shell and TWENEX C-Shell. */
+      fprintf(stdout, "setenv TERM %s\n", term);
+      fprintf(stdout, "setenv LINES %d\n", lines);
+      fprintf(stdout, "setenv COLUMNS %d\n", columns);
+      if (xflag)
+        fprintf(stdout, "setenv TTYCAPS \'%s\'\n", caps);
+      fflush(stdout);
+    } else {
+      /* Bourne derivatives and everything else. */
+      fprintf(stdout, "TERM=\'%s\'; export TERM;\n", term);
+      fprintf(stdout, "LINES=%d; export LINES;\n", lines);
+      fprintf(stdout, "COLUMNS=%d; export COLUMNS;\n", columns);
+      if (xflag)
+        fprintf(stdout, "TTYCAPS=\'%s\'; export TTYCAPS;\n", caps);
+      fflush(stdout);
+    }
+  } else {
+    /* No -s, just print the terminal type (and -x record). */
+    fprintf(stdout, "%s\n", term);
+    if (xflag)
+      fprintf(stdout, "%s\n", caps);
+    fflush(stdout);
+  }
+}
+
+/* }}} */
+/* ================================================================== */
+
+/* ================================================================== */
+/* {{{ Batch mode: */
+
+/*
+ * With -b, every device named on the command line (or, if there are
+ * none, on the standard input) is probed at once, and one line of
+ * "device type" is printed for each.  Each port waits on its own
+ * deadline in a single epoll(7) loop, so a rack of dumb ports costs
+ * one wait rather than one each.
+ */
+
+/*
+ * Purpose:   Gather the devices to work on.
+ * Arguments: argc  - The number of devices.
+ *            argv  - The devices; if there are none, they are read one
+ *                    per line from the standard input.
+ *            count - Set to the number of devices.
+ * Returns:   The devices.
+ */
+static char **
+devList(int argc, char **argv, size_t *count)
+{
+  char **devs = NULL;
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+
+  if (argc > 0) {
+    *count = argc;
+    return argv;
+  }
+
+  *count = 0;
+  while ((len = getline(&line, &size, stdin)) > 0) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0')
+      continue;
+    devs = xrealloc(devs, sizeof(*devs) * (*count + 1));
+    devs[(*count)++] = strdup(line);
+  }
+  free(line);
+
+  return devs;
+}
+
+#ifdef __linux__
+#define PORT_BURST    0                 /* Waiting for the burst. */
+#define PORT_HP       1                 /* Waiting for the HP ID. */
+#define PORT_DONE     2                 /* Finished with. */
+
+struct port {
+  const char *path;                     /* Device file. */
+  int fd;                               /* Open descriptor or -1. */
+  int phase;                            /* See PORT_*. */
+  int settling;                         /* A burst reply has come. */
+  long long sent;                       /* When the probe went. */
+  long long deadline;                   /* When to give up waiting. */
+  struct link link;                     /* How long replies take. */
+  size_t len;                           /* Reply so far. */
+  char buf[256];
+  struct termios saved;                 /* Attributes to restore. */
+  char term[40];                        /* What it turned out to be. */
+};
+
+/*
+ * Purpose:   Send a probe to a port and start waiting for its reply.
+ * Arguments: p      - The port.
+ *            phase  - What is being probed for (see PORT_*).
+ *            probe  - The probe itself.
+ *            expect - The longest reply expected.
+ * Returns:   Nothing.
+ */
+static void
+portSend(struct port *p, int phase, const char *probe, size_t expect)
+{
+  size_t len = strlen(probe);
+
+  p->phase = phase;
+  p->settling = FALSE;
+  p->len = 0;
+  p->buf[0] = '\0';
+  p->sent = nowMs();
+  p->deadline = p->sent + linkWait(&p->link, len, expect);
+
+  /* The probes are far smaller than any tty's output queue. */
+  if (write(p->fd, probe, len) != (ssize_t)len) {
+    perrorf("%s: %s: write", progname, p->path);
+    p->phase = PORT_DONE;
+  }
+}
+
+/*
+ * Purpose:   Make what can be made of a port's reply, and move it on
+ *            to the HP probe or finish with it.
+ * Arguments: p    - The port.
+ *            ep   - The epoll descriptor.
+ *            wyse - TRUE if Wyse terminals are probed for.
+ *            ansi - TRUE if ANSI/DEC terminals are probed for.
+ *            hp   - TRUE if HP terminals are probed for.
+ * Returns:   Nothing.
+ */
+static void
+portReply(struct port *p, int ep, int wyse, int ansi, int hp)
+{
+  showReply(p->path, p->buf, p->len);
+
+  /* The identification routines work on the globals. */
+  memset(term, '\0', sizeof(term));
+  gotTerm = FALSE;
+  termType = TERM_UNKNOWN;
+
+  if (p->phase == PORT_BURST)
+    classifyBurst(p->buf, p->len, wyse, ansi);
+  else if (p->len > 0)
+    setHP(p->buf, p->len);
+
+  if (gotTerm) {
+    snprintf(p->term, sizeof(p->term), "%s", term);
+  } else if (p->phase == PORT_BURST && hp) {
+    portSend(p, PORT_HP, HPID, HPID_REPLY);
+    if (p->phase != PORT_DONE)
+      return;
+  }
+
+  /* Put the port back the way it was found. */
+  p->phase = PORT_DONE;
+  epoll_ctl(ep, EPOLL_CTL_DEL, p->fd, NULL);
+  tcsetattr(p->fd, TCSAFLUSH, &p->saved);
+  close(p->fd);
+  p->fd = -1;
+}
+
+/*
+ * Purpose:   Identify a number of terminals at once.
+ * Arguments: argc - The number of devices.
+ *            argv - The devices; if there are none, they are read one
+ *                   per line from the standard input.
+ *            wyse - TRUE if Wyse terminals are probed for.
+ *            ansi - TRUE if ANSI/DEC terminals are probed for.
+ *            hp   - TRUE if HP terminals are probed for.
+ * Returns:   An exit status.
+ */
+static int
+batch(int argc, char **argv, int wyse, int ansi, int hp)
+{
+  struct epoll_event ev, evs[64];
+  struct port *ports;
+  char **devs;
+  size_t nports, idx;
+  long long now, left;
+  char burst[16];
+  int ep, n, i, active = 0;
+  ssize_t rtn;
+
+  /* Gather the devices. */
+  devs = devList(argc, argv, &nports);
+  if (nports == 0) {
+    fprintf(stderr, "%s: no devices to probe\n", progname);
+    return EXIT_FAILURE;
+  }
+
+  ports = xmalloc(sizeof(*ports) * nports);
+  for (idx = 0; idx < nports; idx++)
+    ports[idx].path = devs[idx];
+
+  if ((ep = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perrorf("%s: epoll_create1", progname);
+    return EXIT_FAILURE;
+  }
+
+  /*
+   * DA is sent before DECID, as for a single terminal.  Every port
+   * shares the one burst.
+   */
+  burstWant = ansi ? 2 : 0;
+  snprintf(burst, sizeof(burst), "%s%s%s",
+           wyse ? WYID : "", ansi ? DECDA : "", ansi ? DECID : "");
+
+  /* Open every port and fire the first probe at it. */
+  for (idx = 0; idx < nports; idx++) {
+    struct port *p = &ports[idx];
+    struct termios raw;
+
+    p->phase = PORT_DONE;
+    strcpy(p->term, "unknown");
+
+    if ((p->fd = open(p->path, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0) {
+      perrorf("%s: Could not open %s", progname, p->path);
+      continue;
+    }
+
+    if (tcgetattr(p->fd, &p->saved) < 0) {
+      perrorf("%s: %s: tcgetattr", progname, p->path);
+      close(p->fd);
+      continue;
+    }
+
+    linkInit(&p->link, p->path, &p->saved);
+    raw = p->saved;
+    makeRaw(&raw);
+    tcflush(p->fd, TCIOFLUSH);
+    tcsetattr(p->fd, TCSANOW, &raw);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = p;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, p->fd, &ev) < 0) {
+      perrorf("%s: %s: epoll_ctl", progname, p->path);
+      tcsetattr(p->fd, TCSANOW, &p->saved);
+      close(p->fd);
+      continue;
+    }
+
+    if (wyse || ansi)
+      portSend(p, PORT_BURST, burst, BURST_REPLY);
+    else
+      portSend(p, PORT_HP, HPID, HPID_REPLY);
+
+    if (p->phase == PORT_DONE) {
+      epoll_ctl(ep, EPOLL_CTL_DEL, p->fd, NULL);
+      tcsetattr(p->fd, TCSANOW, &p->saved);
+      close(p->fd);
+      p->fd = -1;
+    } else {
+      active++;
+    }
+  }
+
+  /* Wait for replies until every port has answered or given up. */
+  while (active > 0) {
+    /* Sleep no longer than the nearest deadline. */
+    left = -1;
+    now = nowMs();
+    for (idx = 0; idx < nports; idx++) {
+      if (ports[idx].phase == PORT_DONE)
+        continue;
+      if (left < 0 || ports[idx].deadline - now < left)
+        left = ports[idx].deadline - now;
+    }
+    if (left < 0)
+      left = 0;
+
+    if ((n = epoll_wait(ep, evs, 64, (int)left)) < 0) {
+      if (errno == EINTR)
+        continue;
+      perrorf("%s: epoll_wait", progname);
+      break;
+    }
+
+    /* Take whatever has arrived on each port. */
+    for (i = 0; i < n; i++) {
+      struct port *p = evs[i].data.ptr;
+      size_t rlen;
+
+      if (p->phase == PORT_DONE)
+        continue;
 
-        tok = strtok(beg, "c");
-        columns = atoi(tok) + 1;
+      rtn = read(p->fd, p->buf + p->len, sizeof(p->buf) - 1 - p->len);
+      if (rtn < 0 && (errno == EAGAIN || errno == EINTR))
+        continue;
+      if (rtn > 0)
+        p->len += rtn;
+      p->buf[p->len] = '\0';
 
-        tok = strtok(NULL, "c");
-        lines = atoi(tok) + 1;
+      if (rtn > 0 && p->link.charUs == 0 && p->link.rtt < 0)
+        p->link.rtt = nowMs() - p->sent;
 
-        /* If we're debugging, print a little info. */
-        if (dflag) {
-          fprintf(stderr,
-                  "%s: HP reports size as %d lines, %d columns\n",
-                  progname,
-                  lines,
-                  columns);
-          fflush(stderr);
-        }
+      if (rtn <= 0 || p->len == sizeof(p->buf) - 1 ||
+          replyDone(p->buf, p->len,
+                    p->phase == PORT_BURST ? REPLY_BURST : '\r'))
+      {
+        p->deadline = 0;
+        continue;
+      }
+
+      /* Replies to the rest of a burst follow close behind the first. */
+      if (p->phase == PORT_BURST && !p->settling &&
+          nextReply(p->buf, p->len, &rlen))
+      {
+        p->settling = TRUE;
+        if (p->deadline > nowMs() + linkSettle(&p->link, BURST_REPLY))
+          p->deadline = nowMs() + linkSettle(&p->link, BURST_REPLY);
       }
     }
+
+    /* Deal with every port that is complete or out of time. */
+    now = nowMs();
+    for (idx = 0; idx < nports; idx++) {
+      struct port *p = &ports[idx];
+
+      if (p->phase == PORT_DONE || p->deadline > now)
+        continue;
+
+      portReply(p, ep, wyse, ansi, hp);
+      if (p->phase == PORT_DONE)
+        active--;
+    }
+  }
+  close(ep);
+
+  /* Anything still open was given up on. */
+  for (idx = 0; idx < nports; idx++) {
+    if (ports[idx].fd >= 0) {
+      tcsetattr(ports[idx].fd, TCSAFLUSH, &ports[idx].saved);
+      close(ports[idx].fd);
+    }
   }
+
+  /* One record per device, in the order they were given. */
+  for (idx = 0; idx < nports; idx++)
+    fprintf(stdout, "%s %s\n", ports[idx].path, ports[idx].term);
+  fflush(stdout);
+
+  return EXIT_SUCCESS;
 }
+#else
+static int
+batch(int argc, char **argv, int wyse, int ansi, int hp)
+{
+  fprintf(stderr, "%s: batch mode needs epoll(7)\n", progname);
+  return EXIT_FAILURE;
+}
+#endif
 
 /* }}} */
-/* ------------------------------------------------------------------ */
+/* ================================================================== */
 
-/* ------------------------------------------------------------------ */
-/* {{{ ioctl routines: */
+/* ================================================================== */
+/* {{{ Port watching: */
 
 /*
- * Purpose:   Attempt to obtain the terminal size using ioctl.
+ * With -d, ttytype watches the carrier (DCD) of each device given to
+ * it, and whenever a terminal comes on line, identifies it and
+ * publishes what it found in a table, one record per port.  Each port
+ * has a process of its own, so that one slow terminal holds up no
+ * other.  With -q, the table is read instead of the terminal, which
+ * is never touched.
+ *
+ * The table is a file mapped by everyone using it.  Each record has a
+ * single writer, and is guarded by a sequence count that is odd
+ * while the record is being written: a reader copies the record and
+ * tries again if the count was odd or has changed meanwhile.
+ */
+
+typedef struct {
+  unsigned int magic;                   /* TABLE_MAGIC. */
+  unsigned int nports;                  /* Records that follow. */
+} tableHdr;
+
+typedef struct {
+  unsigned int seq;                     /* Sequence count. */
+  int carrier;                          /* TRUE if the port is up. */
+  int termType;                         /* One of TERM_*. */
+  int lines;                            /* Lines, or -1 if unknown. */
+  int columns;                          /* Columns, or -1 if unknown. */
+  long long stamp;                      /* When this was written. */
+  char path[64];                        /* The port's device file. */
+  char term[40];                        /* The terminal type. */
+} tableRec;
+
+/* Set by `stopDaemon'. */
+static volatile sig_atomic_t stopping = FALSE;
+
+/*
+ * Purpose:   Find the table of watched ports.
  * Arguments: None.
+ * Returns:   Its path.
+ */
+static const char *
+tablePath(void)
+{
+  const char *path = getenv("TTYTYPE_TABLE");
+
+  return (path != NULL && *path != '\0') ? path : TERMTABLE;
+}
+
+/*
+ * Purpose:   Publish what is known about a port.
+ * Arguments: rec     - The port's record.
+ *            carrier - TRUE if the port has carrier.
  * Returns:   Nothing.
  */
 static void
-sizeIoctl(void)
+tablePublish(tableRec *rec, int carrier)
 {
-  struct winsize w;
+  unsigned int seq = rec->seq;
 
-  bzero(&w, sizeof(w));
-  ioctl(0, TIOCGWINSZ, &w);
+  __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
 
-  lines = w.ws_row;
-  columns = w.ws_col;
+  rec->carrier = carrier;
+  rec->termType = carrier ? termType : TERM_UNKNOWN;
+  rec->lines = carrier ? lines : -1;
+  rec->columns = carrier ? columns : -1;
+  rec->stamp = time(NULL);
+  snprintf(rec->term, sizeof(rec->term), "%s", carrier ? term : "");
 
-  if (dflag) {
+  __atomic_store_n(&rec->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Purpose:   Look up a port in the table of watched ports.
+ * Arguments: port - The port, with or without "/dev/".
+ * Returns:   TRUE if a terminal is on line there, in which case
+ *            `term', `termType', `lines' and `columns' are set;
+ *            otherwise FALSE.
+ */
+static int
+tableLookup(const char *port)
+{
+  char path[MAXPATHLEN];
+  const tableHdr *hdr;
+  const tableRec *recs;
+  tableRec copy;
+  struct stat st;
+  unsigned int seq, idx, tries;
+  int fd, found = FALSE;
+
+  if (port[0] == '/')
+    snprintf(path, sizeof(path), "%s", port);
+  else
+    snprintf(path, sizeof(path), "/dev/%s", port);
+
+  if ((fd = open(tablePath(), O_RDONLY)) < 0)
+    return FALSE;
+
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(tableHdr)) {
+    close(fd);
+    return FALSE;
+  }
+
+  hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (hdr == MAP_FAILED)
+    return FALSE;
+
+  recs = (const tableRec *)(hdr + 1);
+  if (hdr->magic != TABLE_MAGIC ||
+      st.st_size < sizeof(tableHdr) + hdr->nports * sizeof(tableRec))
+  {
+    munmap((void *)hdr, st.st_size);
+    return FALSE;
+  }
+
+  for (idx = 0; idx < hdr->nports; idx++) {
+    if (strncmp(recs[idx].path, path, sizeof(recs[idx].path)) != 0)
+      continue;
+
+    /* A writer that died half way must not hold us up for ever. */
+    for (tries = 0; tries < 1000; tries++) {
+      seq = __atomic_load_n(&recs[idx].seq, __ATOMIC_ACQUIRE);
+      if (seq & 1)
+        continue;
+      memcpy(&copy, &recs[idx], sizeof(copy));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&recs[idx].seq, __ATOMIC_RELAXED) == seq)
+        break;
+    }
+
+    if (tries < 1000 && copy.carrier && copy.term[0] != '\0') {
+      copy.term[sizeof(copy.term) - 1] = '\0';
+      snprintf(term, sizeof(term), "%s", copy.term);
+      termType = copy.termType;
+      lines = copy.lines;
+      columns = copy.columns;
+      found = TRUE;
+    }
+    break;
+  }
+
+  munmap((void *)hdr, st.st_size);
+
+  if (found && vflag) {
     fprintf(stderr,
-            "%s: ioctl reports %d lines, %d columns.\n",
+            "%s: published terminal type \"%s\"\n",
             progname,
-            lines,
-            columns);
+            term);
     fflush(stderr);
   }
+
+  return found;
 }
 
-/* }}} */
-/* ------------------------------------------------------------------ */
+/*
+ * Purpose:   Print what the table says about a port (-q).
+ * Arguments: port - The port.
+ * Returns:   An exit status.
+ */
+static int
+query(const char *port)
+{
+  if (!tableLookup(port)) {
+    fprintf(stderr, "%s: nothing known about %s\n", progname, port);
+    return EXIT_FAILURE;
+  }
 
-/* ------------------------------------------------------------------ */
-/* {{{ Screen size detection: */
+  if (lines < 1 || columns < 1) {
+    lines = defaultLines;
+    columns = defaultColumns;
+  }
+
+  printResult("");
+  return EXIT_SUCCESS;
+}
 
 /*
- * Purpose:   Attempt to ascertain the size of the terminal.
- * Arguments: None.
+ * Purpose:   Put a watched port back as it was, and stop watching it.
+ * Arguments: sig - The signal.
  * Returns:   Nothing.
  */
 static void
-screensize(void)
+stopWatch(int sig)
 {
+  setPrevious(STDIN_FILENO);
+  _exit(EXIT_SUCCESS);
+}
 
-  /*
-   * If we have a terminal, then try the size computation routine for
-   * the relevant terminal type.
-   */
-  if (gotTerm) {
-    if (termType == TERM_WYSE)
-      sizeWyse();
-    else if (termType == TERM_ANSI)
-      sizeANSI();
-    else if (termType == TERM_HP)
-      sizeHP();
+/*
+ * Purpose:   Note that the daemon has been asked to stop.
+ * Arguments: sig - The signal.
+ * Returns:   Nothing.
+ */
+static void
+stopDaemon(int sig)
+{
+  stopping = TRUE;
+}
+
+/*
+ * Purpose:   Watch a port's carrier, identifying the terminal each time
+ *            it comes on line.  Runs in a process of its own, with the
+ *            port as its standard input and `ttystdout', until the port
+ *            goes away.
+ * Arguments: rec  - The port's record.
+ *            wyse - TRUE to probe for Wyse terminals.
+ *            ansi - TRUE to probe for ANSI/DEC terminals.
+ *            hp   - TRUE to probe for HP terminals.
+ * Returns:   Never.
+ */
+static void
+watchPort(tableRec *rec, int wyse, int ansi, int hp)
+{
+  struct termios attr;
+  int fd, bits, up = -1, modem = TRUE;
+
+  if ((fd = open(rec->path, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0) {
+    perrorf("%s: Could not open %s", progname, rec->path);
+    _exit(EXIT_FAILURE);
   }
 
   /*
-   * If lines or columns is equal to -1 then something failed so try
-   * getting the size via ioctl.
+   * Ignore the carrier for the port itself, so that losing it does not
+   * hang the port up under us; it is watched through TIOCMGET instead.
    */
-  if (lines == -1 || columns == -1)
-    sizeIoctl();
+  if (tcgetattr(fd, &attr) == 0) {
+    attr.c_cflag |= CLOCAL;
+    tcsetattr(fd, TCSANOW, &attr);
+  }
+
+  dup2(fd, STDIN_FILENO);
+  if ((ttystdout = fdopen(fd, "w+")) == NULL) {
+    perrorf("%s: %s: fdopen", progname, rec->path);
+    _exit(EXIT_FAILURE);
+  }
+  signal(SIGTERM, stopWatch);
+
+  for (;;) {
+    /* A port without modem control lines is always on line. */
+    if (ioctl(fd, TIOCMGET, &bits) < 0) {
+      if (errno != ENOTTY && errno != EINVAL)
+        break;
+      bits = TIOCM_CD;
+      modem = FALSE;
+    }
+
+    if (((bits & TIOCM_CD) != 0) != up) {
+      up = (bits & TIOCM_CD) != 0;
+
+      /* A new terminal may have come; forget the old one. */
+      memset(term, '\0', sizeof(term));
+      gotTerm = FALSE;
+      termType = TERM_UNKNOWN;
+      lines = columns = -1;
+
+      if (up) {
+        if (tcgetattr(STDIN_FILENO, &attr) == 0)
+          linkInit(&ttyLink, rec->path, &attr);
+
+        identify(wyse, ansi, hp);
+        if (!gotTerm)
+          strncpy(term, "unknown\0", 8);
+        screensize();
+        setPrevious(STDIN_FILENO);
+      }
+
+      tablePublish(rec, up);
+
+      if (vflag) {
+        fprintf(stderr,
+                "%s: %s: %s%s\n",
+                progname,
+                rec->path,
+                up ? "carrier up, terminal " : "carrier down",
+                up ? term : "");
+        fflush(stderr);
+      }
+    }
+
+    if (!modem) {
+      pause();
+      continue;
+    }
+
+#ifdef TIOCMIWAIT
+    /* Sleep until the carrier changes, if the driver can say. */
+    if (ioctl(fd, TIOCMIWAIT, TIOCM_CD) == 0 || errno == EINTR)
+      continue;
+    if (errno != ENOTTY && errno != EINVAL)
+      break;
+#endif
+    sleep(CARRIER_POLL);
+  }
+
+  /* The port has gone; say so, and leave it to the daemon. */
+  perrorf("%s: %s", progname, rec->path);
+  tablePublish(rec, FALSE);
+  _exit(EXIT_FAILURE);
+}
+
+/*
+ * Purpose:   Watch a number of ports, publishing what is on them (-d).
+ * Arguments: argc - The number of devices.
+ *            argv - The devices; if there are none, they are read one
+ *                   per line from the standard input.
+ *            wyse - TRUE to probe for Wyse terminals.
+ *            ansi - TRUE to probe for ANSI/DEC terminals.
+ *            hp   - TRUE to probe for HP terminals.
+ * Returns:   An exit status.
+ */
+static int
+watchPorts(int argc, char **argv, int wyse, int ansi, int hp)
+{
+  const char *path = tablePath();
+  struct sigaction sa;
+  tableHdr *hdr;
+  tableRec *recs;
+  char **devs, tmp[MAXPATHLEN + 8];
+  pid_t *pids, pid;
+  size_t nports, idx, size, running = 0;
+  int fd;
+
+  devs = devList(argc, argv, &nports);
+  if (nports == 0) {
+    fprintf(stderr, "%s: no devices to watch\n", progname);
+    return EXIT_FAILURE;
+  }
 
   /*
-   * If lines or columns is still equal to -1 then something really
-   * failed so just use the default values.
+   * Readers may still have an old table mapped, and would fault if it
+   * were truncated under them, so the new one is made whole beside it
+   * and renamed into place.
    */
-  if (lines == -1 || columns == -1) {
-    lines = defaultLines;
-    columns = defaultColumns;
+  size = sizeof(tableHdr) + nports * sizeof(tableRec);
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  if ((fd = mkstemp(tmp)) < 0) {
+    perrorf("%s: Could not create %s", progname, tmp);
+    return EXIT_FAILURE;
   }
 
-  /* If we're verbose, display some info. */
-  if (vflag) {
-    fprintf(stderr,
-            "%s: COLUMNS=%d; LINES=%d\n",
-            progname,
-            columns,
-            lines);
-    fflush(stderr);
+  if (fchmod(fd, 0644) < 0 || ftruncate(fd, size) < 0) {
+    perrorf("%s: Could not create %s", progname, tmp);
+    close(fd);
+    unlink(tmp);
+    return EXIT_FAILURE;
   }
-}
 
-/* }}} */
-/* ------------------------------------------------------------------ */
+  hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (hdr == MAP_FAILED) {
+    perrorf("%s: mmap", progname);
+    unlink(tmp);
+    return EXIT_FAILURE;
+  }
 
+  recs = (tableRec *)(hdr + 1);
+  for (idx = 0; idx < nports; idx++) {
+    recs[idx].lines = recs[idx].columns = -1;
+    snprintf(recs[idx].path, sizeof(recs[idx].path), "%s", devs[idx]);
+  }
+  hdr->nports = nports;
+  __atomic_store_n(&hdr->magic, TABLE_MAGIC, __ATOMIC_RELEASE);
+
+  if (rename(tmp, path) < 0) {
+    perrorf("%s: Could not create %s", progname, path);
+    munmap(hdr, size);
+    unlink(tmp);
+    return EXIT_FAILURE;
+  }
+
+  /* Stop when asked to; waiting is interrupted, not restarted. */
+  bzero(&sa, sizeof(sa));
+  sa.sa_handler = stopDaemon;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGHUP, &sa, NULL);
+
+  pids = xmalloc(sizeof(*pids) * nports);
+  for (idx = 0; idx < nports; idx++) {
+    if ((pids[idx] = fork()) == 0) {
+      signal(SIGINT, SIG_IGN);
+      signal(SIGHUP, SIG_IGN);
+      watchPort(&recs[idx], wyse, ansi, hp);
+    }
+
+    if (pids[idx] < 0)
+      perrorf("%s: %s: fork", progname, recs[idx].path);
+    else
+      running++;
+  }
+
+  /* Wait for the watchers, which only stop if their port goes. */
+  while (running > 0 && !stopping) {
+    if ((pid = wait(NULL)) < 0) {
+      if (errno != EINTR)
+        break;
+      continue;
+    }
+
+    for (idx = 0; idx < nports; idx++) {
+      if (pids[idx] == pid) {
+        fprintf(stderr, "%s: stopped watching %s\n",
+                progname, recs[idx].path);
+        pids[idx] = -1;
+        running--;
+      }
+    }
+  }
+
+  /* Stop the rest, and take the table away as it is out of date. */
+  for (idx = 0; idx < nports; idx++)
+    if (pids[idx] > 0)
+      kill(pids[idx], SIGTERM);
+  while (wait(NULL) > 0 || errno == EINTR)
+    ;
+  unlink(path);
 
+  return stopping ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
 /* }}} */
 /* ================================================================== */
@@ -938,6 +3145,11 @@ main(int argc, char **argv)
   int restrictANSI = FALSE;     /* True if we're only checking for ANSI */
   int restrictHP = FALSE;       /* True if we're only checking for HP */
   int restrictWyse = FALSE;     /* True if we're only checking for Wyse */
+  int cached = FALSE;           /* True if the cache had the answer */
+  int probed = FALSE;           /* True if the terminal answered */
+  char caps[256] = { 0 };       /* Capability record (-x) */
+  struct termios attr;          /* The terminal's attributes */
+  struct sigaction act;         /* Restores the terminal on signals */
 
   /* Save the program name for later. */
   progname = (char *)basename((const char *)argv[0]);
@@ -949,7 +3161,7 @@ main(int argc, char **argv)
 /* {{{ Parse optargs: */
 
   /* Parse optargs. */
-  while ((c = getopt(argc, argv, "aDpsvt:T:C:R:")) != -1) {
+  while ((c = getopt(argc, argv, "abcdfDpsvxq:t:w:B:T:C:R:")) != -1) {
     switch (c) {
       /*
        * Start with the documented options.
@@ -966,6 +3178,31 @@ main(int argc, char **argv)
       case 'v':   /* Verbose mode. */
         vflag = TRUE;
         break;
+      case 'x':   /* Report what the terminal can do, too. */
+        xflag = TRUE;
+        break;
+      case 'c':   /* Use the detection cache. */
+        cflag = TRUE;
+        break;
+      case 'b':   /* Probe the devices given as operands. */
+        bflag = TRUE;
+        break;
+      case 'd':   /* Watch ports, publishing their terminals. */
+        daemonFlag = TRUE;
+        break;
+      case 'q':   /* Print what was published about a port. */
+        queryPort = optarg;
+        break;
+      case 'f':   /* Detect again, whatever the cache says. */
+        cflag = TRUE;
+        fflag = TRUE;
+        break;
+      case 'w':   /* Wait this long for every reply. */
+        if ((waitMs = atoi(optarg)) <= 0) {
+          fprintf(stderr, "%s: bad wait: %s\n", progname, optarg);
+          exit(2);
+        }
+        break;
       case 't':   /* Restrict enquiry to a specific terminal type. */
         tflag = TRUE;
 
@@ -984,6 +3221,8 @@ main(int argc, char **argv)
       case 'D':   /* Debug mode. */
         dflag = TRUE;
         break;
+      case 'B':   /* Compile a terminal database. */
+        return dbCompile(optarg);
       case 'T':   /* TTY device file to use. */
         strncpy(ttyfile, optarg, MAXPATHLEN);
         break;
@@ -999,7 +3238,8 @@ main(int argc, char **argv)
        */
       default:
         fprintf(stderr,
-                "Usage: %s [-apsv] [-t type]\n",
+                "Usage: %s [-acfpsvx] [-t type] [-w ms] | -b [device ...] |\n"
+                "       -d [device ...] | -q port [-s]\n",
                 progname);
         fflush(stderr);
         exit(2);
@@ -1009,6 +3249,23 @@ main(int argc, char **argv)
 /* }}} */
 /* .................................................................. */
 
+  /* Batch and daemon modes have no terminal of their own. */
+  if (bflag)
+    return batch(argc - optind, argv + optind,
+                 !tflag || restrictWyse,
+                 !tflag || restrictANSI,
+                 !tflag || restrictHP);
+
+  if (daemonFlag)
+    return watchPorts(argc - optind, argv + optind,
+                      !tflag || restrictWyse,
+                      !tflag || restrictANSI,
+                      !tflag || restrictHP);
+
+  /* Nor has -q any need to bother one. */
+  if (queryPort != NULL)
+    return query(queryPort);
+
   /*
    * We want to use the TTY device file for our output so that stdout
    * can be used for other things.
@@ -1031,6 +3288,31 @@ main(int argc, char **argv)
 
   memset(term, '\0', 40);
 
+  /*
+   * The first probe leaves the terminal raw; undo that on the way
+   * out, however that comes about.
+   */
+  atexit(restoreTerm);
+  bzero(&act, sizeof(act));
+  act.sa_handler = handler;
+  sigemptyset(&act.sa_mask);
+  sigaction(SIGINT, &act, NULL);
+  sigaction(SIGTERM, &act, NULL);
+  sigaction(SIGHUP, &act, NULL);
+
+  /* See how long replies ought to take. */
+  if (tcgetattr(STDIN_FILENO, &attr) == 0)
+    linkInit(&ttyLink, ttyname(STDIN_FILENO), &attr);
+
+  if (dflag) {
+    fprintf(stderr,
+            "%s: %ld microseconds a character%s\n",
+            progname,
+            ttyLink.charUs,
+            (ttyLink.charUs == 0) ? " (pty)" : "");
+    fflush(stderr);
+  }
+
 /* .................................................................. */
 /* {{{ Handle -p: */
 
@@ -1055,17 +3337,20 @@ main(int argc, char **argv)
 /* .................................................................. */
 /* {{{ Terminal checks: */
 
-  /* Check for Wyse terminals first. */
-  if (!gotTerm && (!tflag || (tflag && restrictWyse)))
-    identWyse();
-
-  /* Check for ANSI next. */
-  if (!gotTerm && (!tflag || (tflag && restrictANSI)))
-    identANSI();
+  /*
+   * A terminal seen recently needs no probing at all.  The cache
+   * holds what an unrestricted probe found, so -t does without it.
+   */
+  if (!gotTerm && cflag && !tflag && !fflag && cacheLookup())
+    gotTerm = cached = TRUE;
 
-  /* Lastly check for HP. */
-  if (!gotTerm && (!tflag || (tflag && restrictHP)))
-    identHP();
+  /* Probe for the terminal, unless -t says otherwise. */
+  if (!gotTerm) {
+    identify(!tflag || restrictWyse,
+             !tflag || restrictANSI,
+             !tflag || restrictHP);
+    probed = gotTerm;
+  }
 
   /* If we still don't have a terminal... */
   if (!gotTerm) {
@@ -1074,6 +3359,9 @@ main(int argc, char **argv)
       /* ... then we get to prompt. */
       int size = -1;
 
+      /* The user needs to see what they type. */
+      setPrevious(STDIN_FILENO);
+
       /* Ask the user for the terminal. */
       fprintf(ttystdout, "TERM = (vt100) ");
       fflush(ttystdout);
@@ -1107,6 +3395,16 @@ main(int argc, char **argv)
 /* }}} */
 /* .................................................................. */
 
+/* .................................................................. */
+/* {{{ Handle -x: */
+
+  /* ANSI terminals can be asked what else they can do. */
+  if (xflag && termType == TERM_ANSI)
+    identCaps(caps, sizeof(caps));
+
+/* }}} */
+/* .................................................................. */
+
 /* .................................................................. */
 /* {{{ Handle -s: */
 
@@ -1115,46 +3413,27 @@ main(int argc, char **argv)
  * redirected and used by a script or whatnot.
  */
   if (sflag) {
-    char *shell;
-
     /*
-     * Allocate space for the shell then attempt to get it from the
-     * environment.
+     * The window may have changed size since it was cached, and the
+     * kernel can say so without bothering the terminal.
      */
-    shell = xmalloc(sizeof(char) * MAXPATHLEN);
-    shell = basename((char *)getenv("SHELL"));
+    if (cached)
+      sizeIoctl();
 
     /* Toddle off and get the screen dimensions. */
-    screensize();
-
-    /*
-     * Use the `SHELL' environment variable to compute exactly how to
-     * display the values.
-     */
-    if (strncmp(shell, "csh", 3) == 0 ||
-        strncmp(shell, "tcsh", 4) == 0)
-    {
-      /* C-Shell and TWENEX C-Shell. */
-      fprintf(stdout, "setenv TERM %s\n", term);
-      fprintf(stdout, "setenv LINES %d\n", lines);
-      fprintf(stdout, "setenv COLUMNS %d\n", columns);
-      fflush(stdout);
-    } else {
-      /* Bourne derivatives and everything else. */
-      fprintf(stdout, "TERM=\'%s\'; export TERM;\n", term);
-      fprintf(stdout, "LINES=%d; export LINES;\n", lines);
-      fprintf(stdout, "COLUMNS=%d; export COLUMNS;\n", columns);
-      fflush(stdout);
-    }
-  } else {
-    /* No -s, just print the terminal type. */
-    fprintf(stdout, "%s\n", term);
-    fflush(stdout);
+    if (!cached || lines == -1 || columns == -1)
+      screensize();
   }
 
+  printResult(caps);
+
 /* }}} */
 /* .................................................................. */
 
+  /* Remember what was detected (not typed) for next time. */
+  if (cflag && !tflag && probed)
+    cacheStore();
+
   /* And we're done. */
   return EXIT_SUCCESS;
 }